@@ -16,26 +16,51 @@ extern "C"
     /*
      * intのkeyを用いた単純なhashlist + fifo message list
      *  *** データの実体も持ちます
+     *
+     * hashはopen addressing(linear probing)で、使用率に応じて拡張します。
+     * slotにはkey毎のlist(古い順)を持ちます。
+     * fifo, key毎のlistとも双方向listなので、要素の削除はlistをたどりません。
      */
 
 #include "poolalloc.h"
 
+#define MESSAGE_LOAD_FACTOR_NUM 3 // slot使用率(tombstone含む)がNUM/DENを超えたら拡張
+#define MESSAGE_LOAD_FACTOR_DEN 4
+
+#define MESSAGE_SLOT_EMPTY 0 // 未使用slot
+#define MESSAGE_SLOT_USED 1  // 使用中slot
+#define MESSAGE_SLOT_TOMB 2  // 削除済みslot(検索は継続する)
+
     typedef struct _element
     {
-        struct _element *next;
+        struct _element *next; // fifo list
+        struct _element *prev; // fifo list
 
-        struct _element *hashnext;
+        struct _element *hashnext; // key毎のlist(新しい方へ)
+        struct _element *hashprev; // key毎のlist(古い方へ)
 
         uintptr_t key;
         char data[];
     } element_t;
 
+    typedef struct
+    {
+        uintptr_t key;   // key
+        int state;       // MESSAGE_SLOT_*
+        element_t *top;  // key毎のlist(最も古いもの)
+        element_t *last; // key毎のlist(最も新しいもの)
+    } keyslot_t;
+
     typedef struct
     {
         int basenum;
         int datasize;
 
-        element_t **element;
+        keyslot_t *slot; // hash table
+        int capacity;    // slot数(2のべき乗)
+        int n_used;      // 使用中slot数
+        int n_tomb;      // 削除済みslot数
+
         element_t *top;
         element_t *last;
 
@@ -44,6 +69,147 @@ extern "C"
 
     static inline void message_delete_one(void *m);
 
+    /**
+     * keyのhash値.
+     * （pointerは下位bitが揃っているので、かき混ぜてから使う）
+     *
+     * @param uintptr_t key
+     * @return uint64_t
+     */
+    static inline uint64_t __message_hash(uintptr_t key)
+    {
+        uint64_t h = (uint64_t)key;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /**
+     * hash tableの確保.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param messageheader_t *msg
+     * @param int capacity : 2のべき乗
+     * @return int : 成功:1 / 失敗:0
+     */
+    static inline int __message_alloc_slot(messageheader_t *msg, int capacity)
+    {
+        keyslot_t *slot = (keyslot_t *)calloc(capacity, sizeof(keyslot_t));
+        if (slot == NULL)
+        {
+            return 0;
+        }
+        keyslot_t *old = msg->slot;
+        int old_capacity = msg->capacity;
+
+        msg->slot = slot;
+        msg->capacity = capacity;
+        msg->n_used = 0;
+        msg->n_tomb = 0;
+
+        // 使用中のものを移す
+        int i;
+        for (i = 0; i < old_capacity; i++)
+        {
+            if (old[i].state == MESSAGE_SLOT_USED)
+            {
+                uint64_t idx = __message_hash(old[i].key) & (capacity - 1);
+                while (slot[idx].state != MESSAGE_SLOT_EMPTY)
+                {
+                    idx = (idx + 1) & (capacity - 1);
+                }
+                slot[idx] = old[i];
+                msg->n_used++;
+            }
+        }
+        free(old);
+        return 1;
+    }
+
+    /**
+     * keyのslot検索.
+     *
+     * @param messageheader_t *msg
+     * @param uintptr_t key
+     * @return keyslot_t * : 見つからない:NULL
+     */
+    static inline keyslot_t *__message_find_slot(messageheader_t *msg, uintptr_t key)
+    {
+        uint64_t mask = msg->capacity - 1;
+        uint64_t idx = __message_hash(key) & mask;
+        while (msg->slot[idx].state != MESSAGE_SLOT_EMPTY)
+        {
+            if ((msg->slot[idx].state == MESSAGE_SLOT_USED) && (msg->slot[idx].key == key))
+            {
+                return &(msg->slot[idx]);
+            }
+            idx = (idx + 1) & mask;
+        }
+        return NULL;
+    }
+
+    /**
+     * keyのslot検索(なければ追加).
+     *
+     * @param messageheader_t *msg
+     * @param uintptr_t key
+     * @return keyslot_t * : 失敗:NULL
+     */
+    static inline keyslot_t *__message_get_slot(messageheader_t *msg, uintptr_t key)
+    {
+        keyslot_t *ks = __message_find_slot(msg, key);
+        if (ks != NULL)
+        {
+            return ks;
+        }
+
+        if ((msg->n_used + msg->n_tomb + 1) * MESSAGE_LOAD_FACTOR_DEN > msg->capacity * MESSAGE_LOAD_FACTOR_NUM)
+        {
+            // 使用中が多ければ倍に、削除済みが多いだけなら同じサイズで作り直す
+            int capacity = ((msg->n_used + 1) * MESSAGE_LOAD_FACTOR_DEN * 2 > msg->capacity * MESSAGE_LOAD_FACTOR_NUM) ? msg->capacity * 2 : msg->capacity;
+            if (!__message_alloc_slot(msg, capacity))
+            {
+                return NULL;
+            }
+        }
+
+        uint64_t mask = msg->capacity - 1;
+        uint64_t idx = __message_hash(key) & mask;
+        while (msg->slot[idx].state == MESSAGE_SLOT_USED)
+        {
+            idx = (idx + 1) & mask;
+        }
+        ks = &(msg->slot[idx]);
+        if (ks->state == MESSAGE_SLOT_TOMB)
+        {
+            msg->n_tomb--;
+        }
+        ks->key = key;
+        ks->state = MESSAGE_SLOT_USED;
+        ks->top = NULL;
+        ks->last = NULL;
+        msg->n_used++;
+        return ks;
+    }
+
+    /**
+     * slotの削除.
+     *
+     * @param messageheader_t *msg
+     * @param keyslot_t *ks
+     */
+    static inline void __message_del_slot(messageheader_t *msg, keyslot_t *ks)
+    {
+        ks->state = MESSAGE_SLOT_TOMB;
+        ks->top = NULL;
+        ks->last = NULL;
+        msg->n_used--;
+        msg->n_tomb++;
+    }
+
     /**
      * message管理構造体の開放.
      *
@@ -53,14 +219,14 @@ extern "C"
     {
         messageheader_t *msg = (messageheader_t *)m;
 
-        if (msg->element != NULL)
+        if (msg->slot != NULL)
         {
             while (msg->top != NULL)
             {
                 message_delete_one(m);
             }
-            free(msg->element);
-            msg->element = NULL;
+            free(msg->slot);
+            msg->slot = NULL;
         }
 
         if (msg->element_a != NULL)
@@ -75,36 +241,36 @@ extern "C"
     /**
      * message管理構造体の初期化.
      *
-     * @param int basenum
+     * @param int basenum : hash tableの初期サイズ(2のべき乗に切り上げます)
      * @param  int datasize
      * @param  int initial_num
      * @return static
      */
     static inline void *message_create(int basenum, int datasize, int initial_num)
     {
-        int i;
-
-        messageheader_t *msg = (messageheader_t *)malloc(sizeof(messageheader_t));
+        messageheader_t *msg = (messageheader_t *)calloc(1, sizeof(messageheader_t));
         if (msg == NULL)
         {
             return NULL;
         }
         msg->basenum = basenum;
         msg->datasize = datasize;
-        msg->element = (element_t **)malloc(sizeof(element_t *) * msg->basenum);
-        if (msg->element == NULL)
+
+        int capacity = 8;
+        while (capacity < basenum)
         {
-            free(msg);
-            return NULL;
+            capacity <<= 1;
         }
-        for (i = 0; i < msg->basenum; i++)
+        if (!__message_alloc_slot(msg, capacity))
         {
-            msg->element[i] = NULL;
+            free(msg);
+            return NULL;
         }
         msg->top = NULL;
         msg->last = NULL;
 
-        msg->element_a = init_pool(sizeof(element_t) + msg->datasize, initial_num);
+        // 要素は小さいのでelement headerなし(bitmap管理)のpoolを使う
+        msg->element_a = init_pool_with_option(sizeof(element_t) + msg->datasize, initial_num, 0, POOL_OPT_BITMAP);
         if (msg->element_a == NULL)
         {
             message_release(msg);
@@ -124,20 +290,17 @@ extern "C"
      */
     static inline element_t *__message_find(messageheader_t *msg, uintptr_t key)
     {
-        element_t *elem = NULL;
-        for (elem = msg->element[key % msg->basenum]; elem; elem = elem->hashnext)
+        keyslot_t *ks = __message_find_slot(msg, key);
+        if (ks == NULL)
         {
-            if (key == elem->key)
-            {
-                return elem;
-            }
+            return NULL;
         }
-        return NULL;
+        return ks->last;
     }
 
     /**
      * keyによる検索.
-     * （valueを返す）
+     * （同一keyのもののうち、最も新しいもののvalueを返す）
      *
      * @param void *m
      * @param  uintptr_t key
@@ -157,45 +320,75 @@ extern "C"
     }
 
     /**
-     * hashからの削除.
+     * fifoからの削除.
+     * （共通処理。外部から呼ばれることは考えていません）
      *
      * @param messageheader_t *msg
-     * @param  int key
+     * @param element_t *e
      */
-    static inline void __message_del_hash(messageheader_t *msg, uintptr_t key)
+    static inline void __message_unlink_fifo(messageheader_t *msg, element_t *e)
     {
-        element_t *prev = NULL;
-        element_t *elem = NULL;
-        element_t *delelem = NULL;
-        uintptr_t idx = key % msg->basenum;
+        if (e->prev != NULL)
+        {
+            e->prev->next = e->next;
+        }
+        else
+        {
+            msg->top = e->next;
+        }
+        if (e->next != NULL)
+        {
+            e->next->prev = e->prev;
+        }
+        else
+        {
+            msg->last = e->prev;
+        }
+    }
 
-        for (elem = msg->element[idx]; elem; elem = elem->hashnext)
+    /**
+     * key毎のlistからの削除.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param messageheader_t *msg
+     * @param element_t *e
+     */
+    static inline void __message_unlink_key(messageheader_t *msg, element_t *e)
+    {
+        if ((e->hashprev != NULL) && (e->hashnext != NULL))
         {
-            if (delelem != NULL)
-            {
-                pool_free(msg->element_a, delelem);
-                delelem = NULL;
-            }
-            if (key == elem->key)
-            {
-                if (prev == NULL)
-                {
-                    msg->element[idx] = elem->hashnext;
-                }
-                else
-                {
-                    prev->hashnext = elem->hashnext;
-                }
-                delelem = elem;
-                continue; // keyは重複がありうるので続行
-            }
-            prev = elem;
+            // 途中の要素なのでslotは変わらない
+            e->hashprev->hashnext = e->hashnext;
+            e->hashnext->hashprev = e->hashprev;
+            return;
         }
 
-        if (delelem != NULL)
+        keyslot_t *ks = __message_find_slot(msg, e->key);
+        if (ks == NULL)
+        {
+            return;
+        }
+        if (e->hashprev != NULL)
+        {
+            e->hashprev->hashnext = e->hashnext;
+        }
+        else
+        {
+            ks->top = e->hashnext;
+        }
+        if (e->hashnext != NULL)
+        {
+            e->hashnext->hashprev = e->hashprev;
+        }
+        else
         {
-            pool_free(msg->element_a, delelem);
-            delelem = NULL;
+            ks->last = e->hashprev;
+        }
+
+        if (ks->top == NULL)
+        {
+            // このkeyのものはなくなった
+            __message_del_slot(msg, ks);
         }
     }
 
@@ -209,28 +402,22 @@ extern "C"
     static inline void message_del(void *m, uintptr_t key)
     {
         messageheader_t *msg = (messageheader_t *)m;
-        element_t *prev = NULL;
-        element_t *elem = NULL;
-
-        for (elem = msg->top; elem; elem = elem->next)
+        keyslot_t *ks = __message_find_slot(msg, key);
+        if (ks == NULL)
         {
-            if (key == elem->key)
-            {
-                if (prev == NULL)
-                {
-                    msg->top = elem->next;
-                }
-                else
-                {
-                    prev->next = elem->next;
-                }
-                continue; // keyは重複がありうるので続行
-            }
-            prev = elem;
+            return;
         }
-        msg->last = prev;
 
-        __message_del_hash(msg, key); // elementのfreeはこの中で行う
+        // key毎のlistをたどって、fifoから外して解放する
+        element_t *elem = ks->top;
+        while (elem != NULL)
+        {
+            element_t *next = elem->hashnext;
+            __message_unlink_fifo(msg, elem);
+            pool_free(msg->element_a, elem);
+            elem = next;
+        }
+        __message_del_slot(msg, ks);
         return;
     }
 
@@ -248,18 +435,37 @@ extern "C"
 
         // hashkeyとの一番の違いは重複キーを許すこと
 
+        keyslot_t *ks = __message_get_slot(msg, key);
+        if (ks == NULL)
+        {
+            return NULL;
+        }
+
         elem = (element_t *)pool_alloc(msg->element_a);
         if (elem == NULL)
         {
+            if (ks->top == NULL)
+            {
+                __message_del_slot(msg, ks);
+            }
             return NULL;
         }
 
-        // hashlistの先頭に追加
-        int idx = key % msg->basenum;
+        // key毎のlistの最後に追加
         elem->key = key;
         elem->next = NULL;
-        elem->hashnext = msg->element[idx];
-        msg->element[idx] = elem;
+        elem->prev = msg->last;
+        elem->hashnext = NULL;
+        elem->hashprev = ks->last;
+        if (ks->last != NULL)
+        {
+            ks->last->hashnext = elem;
+        }
+        else
+        {
+            ks->top = elem;
+        }
+        ks->last = elem;
 
         // msglistの最後に追加
         if (msg->last != NULL)
@@ -302,31 +508,8 @@ extern "C"
         messageheader_t *msg = (messageheader_t *)m;
         element_t *e = msg->top;
 
-        if (msg->last == e)
-        {
-            msg->last = NULL;
-        }
-        msg->top = e->next;
-
-        int idx = e->key % msg->basenum;
-        element_t *prev = NULL;
-        element_t *elem = NULL;
-        for (elem = msg->element[idx]; elem; elem = elem->hashnext)
-        {
-            if (e == elem)
-            {
-                if (prev == NULL)
-                {
-                    msg->element[idx] = elem->hashnext;
-                }
-                else
-                {
-                    prev->hashnext = elem->hashnext;
-                }
-                break;
-            }
-            prev = elem;
-        }
+        __message_unlink_fifo(msg, e);
+        __message_unlink_key(msg, e);
 
         pool_free(msg->element_a, e);
 
@@ -345,10 +528,14 @@ extern "C"
         element_t *elem = NULL;
         int i;
 
-        for (i = 0; i < msg->basenum; i++)
+        for (i = 0; i < msg->capacity; i++)
         {
+            if (msg->slot[i].state != MESSAGE_SLOT_USED)
+            {
+                continue;
+            }
             printf("ELEMENT[%d] : ", i);
-            for (elem = msg->element[i]; elem; elem = elem->hashnext)
+            for (elem = msg->slot[i].top; elem; elem = elem->hashnext)
             {
                 printf("->[%" PRIuPTR "] %p %p", elem->key, elem, elem->data);
             }
@@ -0,0 +1,458 @@
+#if !defined(__MTPOOLALLOC_H_INCLUDED__)
+#define __MTPOOLALLOC_H_INCLUDED__
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // thread safeなメモリプール
+    // ・poolalloc.hのpoolの前段にthread毎のcache(magazine)を置きます
+    // ・thread毎に2つのmagazine(loaded, prev)を持ち、通常はlockなしで確保・解放します
+    // ・magazineが空/満杯になったときだけlockを取り、共有のdepotとmagazine単位でやりとりします
+    // ・他threadで確保された要素を解放しても構いません（解放したthreadのmagazineに入ります）
+    // ・thread毎のcacheは全poolで1つのpthread_keyにlistでつなぎます（pool数がPTHREAD_KEYS_MAXに縛られないように）
+    // ・使用中要素の走査(get_element_first等)はできません
+
+#include "poolalloc.h"
+
+#define MTPOOL_MAGAZINE_SIZE 32 // magazineの要素数(default)
+
+    static pthread_key_t __mtpool_key;                                       // thread毎のcache list(全poolで共有)
+    static pthread_once_t __mtpool_key_once = PTHREAD_ONCE_INIT;             // __mtpool_keyの作成
+    static int __mtpool_key_ok = 0;                                          // __mtpool_keyが作成できたか
+    static pthread_mutex_t __mtpool_owner_lock = PTHREAD_MUTEX_INITIALIZER; // cacheのowner(pool解放とthread終了)用lock
+
+    typedef struct _mtmagazine_t
+    {
+        struct _mtmagazine_t *next; // 次magazine(depot list用)
+        int n;                      // 格納数
+        void *element[];            // 未使用要素
+    } mtmagazine_t;
+
+    typedef struct _mtcache_t
+    {
+        struct _mtcache_t *next;  // 次cache(登録list用)
+        struct _mtcache_t *prev;  // 前cache(登録list用)
+        struct _mtcache_t *tnext; // 次cache(thread内list用)
+        struct _mtpool_t *owner;  // 所属pool(poolが解放されたらNULL。__atomicで読み書きする)
+        mtmagazine_t *loaded;     // 使用中magazine
+        mtmagazine_t *previous;   // 予備magazine
+    } mtcache_t;
+
+    typedef struct _mtpool_t
+    {
+        int mag_size;          // magazineの要素数
+        pthread_mutex_t lock;  // depot, pool用lock
+        void *pool;            // 実体のpool(lockして使う)
+        mtmagazine_t *full;    // depot : 満杯のmagazine list
+        mtmagazine_t *empty;   // depot : 空のmagazine list
+        mtcache_t *caches;     // 全threadのcache list
+    } mtpool_t;
+
+    /**
+     * magazineの確保.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mtpool_t *mtp
+     * @return mtmagazine_t *
+     */
+    static inline mtmagazine_t *__mtpool_new_magazine(mtpool_t *mtp)
+    {
+        mtmagazine_t *m = (mtmagazine_t *)malloc(sizeof(mtmagazine_t) + sizeof(void *) * mtp->mag_size);
+        if (m != NULL)
+        {
+            m->next = NULL;
+            m->n = 0;
+        }
+        return m;
+    }
+
+    /**
+     * magazine内の要素をpoolへ返す.
+     * （共通処理。lockして呼ぶこと）
+     *
+     * @param mtpool_t *mtp
+     * @param mtmagazine_t *m
+     */
+    static inline void __mtpool_drain_magazine(mtpool_t *mtp, mtmagazine_t *m)
+    {
+        while (m->n > 0)
+        {
+            pool_free(mtp->pool, m->element[--m->n]);
+        }
+    }
+
+    /**
+     * thread終了時のcache解放.
+     * （pthread_keyのdestructor）
+     *
+     * @param void *arg : threadのcache list
+     */
+    static inline void __mtpool_cache_destructor(void *arg)
+    {
+        mtcache_t *cache = (mtcache_t *)arg;
+
+        pthread_mutex_lock(&__mtpool_owner_lock);
+        while (cache != NULL)
+        {
+            mtcache_t *tnext = cache->tnext;
+            mtpool_t *mtp = cache->owner;
+            if (mtp != NULL)
+            {
+                pthread_mutex_lock(&(mtp->lock));
+                // 要素はpoolへ返し、magazineはdepotで再利用する
+                mtmagazine_t *mags[2] = {cache->loaded, cache->previous};
+                int i;
+                for (i = 0; i < 2; i++)
+                {
+                    if (mags[i] != NULL)
+                    {
+                        __mtpool_drain_magazine(mtp, mags[i]);
+                        mags[i]->next = mtp->empty;
+                        mtp->empty = mags[i];
+                    }
+                }
+                // 登録listから外す
+                if (cache->prev != NULL)
+                {
+                    cache->prev->next = cache->next;
+                }
+                else
+                {
+                    mtp->caches = cache->next;
+                }
+                if (cache->next != NULL)
+                {
+                    cache->next->prev = cache->prev;
+                }
+                pthread_mutex_unlock(&(mtp->lock));
+            }
+            // ownerがNULLならpoolの解放時にmagazineも解放済み
+            free(cache);
+            cache = tnext;
+        }
+        pthread_mutex_unlock(&__mtpool_owner_lock);
+    }
+
+    /**
+     * __mtpool_keyの作成.
+     * （pthread_onceから呼ばれる）
+     */
+    static inline void __mtpool_key_create(void)
+    {
+        __mtpool_key_ok = (pthread_key_create(&__mtpool_key, __mtpool_cache_destructor) == 0);
+    }
+
+    /**
+     * 呼び出しthreadのcacheを得る.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * threadのcache listからpoolのcacheを探す。見つけたcacheはlistの先頭に移す。
+     * 途中にある解放済みpoolのcacheはここで解放する
+     *
+     * @param mtpool_t *mtp
+     * @return mtcache_t *
+     */
+    static inline mtcache_t *__mtpool_get_cache(mtpool_t *mtp)
+    {
+        mtcache_t *head = (mtcache_t *)pthread_getspecific(__mtpool_key);
+        if ((head != NULL) && (__atomic_load_n(&(head->owner), __ATOMIC_ACQUIRE) == mtp))
+        {
+            return head;
+        }
+
+        mtcache_t *cache = NULL;
+        mtcache_t **pp = &head;
+        while (*pp != NULL)
+        {
+            mtcache_t *c = *pp;
+            mtpool_t *owner = __atomic_load_n(&(c->owner), __ATOMIC_ACQUIRE);
+            if (owner == mtp)
+            {
+                *pp = c->tnext;
+                cache = c;
+                break;
+            }
+            if (owner == NULL)
+            {
+                // 解放済みpoolのcache
+                *pp = c->tnext;
+                free(c);
+                continue;
+            }
+            pp = &(c->tnext);
+        }
+
+        if (cache == NULL)
+        {
+            // このthreadで初めての使用
+            cache = (mtcache_t *)calloc(1, sizeof(mtcache_t));
+            if (cache != NULL)
+            {
+                cache->owner = mtp;
+                cache->loaded = __mtpool_new_magazine(mtp);
+                cache->previous = __mtpool_new_magazine(mtp);
+                if ((cache->loaded == NULL) || (cache->previous == NULL))
+                {
+                    free(cache->loaded);
+                    free(cache->previous);
+                    free(cache);
+                    cache = NULL;
+                }
+                else
+                {
+                    pthread_mutex_lock(&(mtp->lock));
+                    cache->next = mtp->caches;
+                    if (mtp->caches != NULL)
+                    {
+                        mtp->caches->prev = cache;
+                    }
+                    mtp->caches = cache;
+                    pthread_mutex_unlock(&(mtp->lock));
+                }
+            }
+        }
+
+        if (cache != NULL)
+        {
+            cache->tnext = head;
+            head = cache;
+        }
+        pthread_setspecific(__mtpool_key, head);
+        return cache;
+    }
+
+    /**
+     * 初期化.
+     *
+     * @param int size : 要素のサイズ
+     * @param int num : 初期要素数
+     * @param int max_num : 最大要素数(0:制限なし)
+     * @param int flags : POOL_OPT_*
+     * @param int mag_size : magazineの要素数(0:default)
+     * @return void *
+     */
+    static inline void *init_mtpool(int size, int num, int max_num, int flags, int mag_size)
+    {
+        mtpool_t *mtp = (mtpool_t *)calloc(1, sizeof(mtpool_t));
+        if (mtp == NULL)
+        {
+            return NULL;
+        }
+        mtp->mag_size = (mag_size > 0) ? mag_size : MTPOOL_MAGAZINE_SIZE;
+
+        mtp->pool = init_pool_with_option(size, num, max_num, flags);
+        if (mtp->pool == NULL)
+        {
+            free(mtp);
+            return NULL;
+        }
+        pthread_once(&__mtpool_key_once, __mtpool_key_create);
+        if (!__mtpool_key_ok)
+        {
+            release_pool(mtp->pool);
+            free(mtp);
+            return NULL;
+        }
+        pthread_mutex_init(&(mtp->lock), NULL);
+
+        return (void *)mtp;
+    }
+
+    /**
+     * 解放.
+     *
+     * 他threadがこのpoolを使っていない状態で呼び出してください。
+     * 各threadのcacheはthreadのlistに残るので、ownerを外しておき、
+     * そのthreadが次にcacheを探した時(またはthread終了時)に解放されます
+     *
+     * @param void *mp
+     */
+    static inline void release_mtpool(void *mp)
+    {
+        mtpool_t *mtp = (mtpool_t *)mp;
+
+        pthread_mutex_lock(&__mtpool_owner_lock);
+        mtcache_t *cache = mtp->caches;
+        while (cache != NULL)
+        {
+            mtcache_t *next = cache->next; // ownerを外すとthread側で解放されるので先に読む
+            free(cache->loaded);
+            free(cache->previous);
+            cache->loaded = NULL;
+            cache->previous = NULL;
+            __atomic_store_n(&(cache->owner), NULL, __ATOMIC_RELEASE);
+            cache = next;
+        }
+        pthread_mutex_unlock(&__mtpool_owner_lock);
+        mtmagazine_t *lists[2] = {mtp->full, mtp->empty};
+        int i;
+        for (i = 0; i < 2; i++)
+        {
+            mtmagazine_t *m = lists[i];
+            while (m != NULL)
+            {
+                mtmagazine_t *next = m->next;
+                free(m);
+                m = next;
+            }
+        }
+
+        release_pool(mtp->pool);
+        pthread_mutex_destroy(&(mtp->lock));
+        free(mtp);
+    }
+
+    /**
+     * 要素の取得.
+     *
+     * @param void *mp
+     * @return void *
+     */
+    static inline void *mtpool_alloc(void *mp)
+    {
+        mtpool_t *mtp = (mtpool_t *)mp;
+        mtcache_t *cache = __mtpool_get_cache(mtp);
+        if (cache == NULL)
+        {
+            return NULL;
+        }
+
+        if (cache->loaded->n > 0)
+        {
+            return cache->loaded->element[--cache->loaded->n];
+        }
+        if (cache->previous->n > 0)
+        {
+            // 予備と入れ替え
+            mtmagazine_t *m = cache->loaded;
+            cache->loaded = cache->previous;
+            cache->previous = m;
+            return cache->loaded->element[--cache->loaded->n];
+        }
+
+        // 両方空なので、depotから満杯のmagazineをもらう
+        pthread_mutex_lock(&(mtp->lock));
+        if (mtp->full != NULL)
+        {
+            mtmagazine_t *m = mtp->full;
+            mtp->full = m->next;
+            cache->previous->next = mtp->empty;
+            mtp->empty = cache->previous;
+            cache->previous = cache->loaded;
+            cache->loaded = m;
+        }
+        else
+        {
+            // depotにもないので、poolからまとめて確保する
+            mtmagazine_t *m = cache->loaded;
+            while (m->n < mtp->mag_size / 2 + 1)
+            {
+                void *e = pool_alloc(mtp->pool);
+                if (e == NULL)
+                {
+                    break;
+                }
+                m->element[m->n++] = e;
+            }
+        }
+        pthread_mutex_unlock(&(mtp->lock));
+
+        if (cache->loaded->n == 0)
+        {
+            return NULL;
+        }
+        return cache->loaded->element[--cache->loaded->n];
+    }
+
+    /**
+     * 要素の開放.
+     *
+     * @param void *mp
+     * @param void *element
+     */
+    static inline void mtpool_free(void *mp, void *element)
+    {
+        mtpool_t *mtp = (mtpool_t *)mp;
+        mtcache_t *cache = __mtpool_get_cache(mtp);
+        if (cache == NULL)
+        {
+            // cacheが作れないので直接poolへ返す
+            pthread_mutex_lock(&(mtp->lock));
+            pool_free(mtp->pool, element);
+            pthread_mutex_unlock(&(mtp->lock));
+            return;
+        }
+
+        if (cache->loaded->n < mtp->mag_size)
+        {
+            cache->loaded->element[cache->loaded->n++] = element;
+            return;
+        }
+        if (cache->previous->n == 0)
+        {
+            // 予備(空)と入れ替え
+            mtmagazine_t *m = cache->loaded;
+            cache->loaded = cache->previous;
+            cache->previous = m;
+            cache->loaded->element[cache->loaded->n++] = element;
+            return;
+        }
+
+        // 両方満杯なので、満杯のmagazineをdepotへ渡して空のmagazineをもらう
+        pthread_mutex_lock(&(mtp->lock));
+        mtmagazine_t *m = mtp->empty;
+        if (m == NULL)
+        {
+            pthread_mutex_unlock(&(mtp->lock));
+            m = __mtpool_new_magazine(mtp);
+            pthread_mutex_lock(&(mtp->lock));
+            if (m == NULL)
+            {
+                // magazineが作れないので直接poolへ返す
+                pool_free(mtp->pool, element);
+                pthread_mutex_unlock(&(mtp->lock));
+                return;
+            }
+        }
+        else
+        {
+            mtp->empty = m->next;
+        }
+        cache->previous->next = mtp->full;
+        mtp->full = cache->previous;
+        pthread_mutex_unlock(&(mtp->lock));
+
+        m->next = NULL;
+        m->n = 0;
+        cache->previous = cache->loaded;
+        cache->loaded = m;
+        cache->loaded->element[cache->loaded->n++] = element;
+    }
+
+    /**
+     * poolから確保されている数を返す.
+     * （magazineに入っている未使用要素も含みます）
+     *
+     * @param void *mp
+     * @return int
+     */
+    static inline int get_mtpool_use_num(void *mp)
+    {
+        mtpool_t *mtp = (mtpool_t *)mp;
+
+        pthread_mutex_lock(&(mtp->lock));
+        int n = get_element_use_num(mtp->pool);
+        pthread_mutex_unlock(&(mtp->lock));
+        return n;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !defined (__MTPOOLALLOC_H_INCLUDED__) */
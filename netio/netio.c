@@ -6,15 +6,24 @@
  *
  */
 
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -36,7 +45,7 @@
 #include "netio.h"
 
 #include "poolalloc.h"
-#include "message.h"
+#include "mtpoolalloc.h"
 
 // #include "addrsearch.h"
 
@@ -66,12 +75,51 @@ static int NIO_DEBUG = 0; // debug flag
 #define _PUSH_BUFFER_NUM_PAR_LOOP 128
 #endif
 #define _MAX_CONNECTION_NUM 65536 * 4 // これ以上は絶対にコネクションしないという数
+#if !defined NIO_POOL_OPTION
+#define NIO_POOL_OPTION 0 // コネクション、バッファのpool option (POOL_OPT_HUGEPAGE | POOL_OPT_PREFAULT等)
+#endif
+#define POOL_GROW_AHEAD_RATIO 4 // 空きが1/POOL_GROW_AHEAD_RATIOを切ったらpollの合間に拡張しておく
+#define POOL_TRIM_RATIO 2		// 使用数が容量の1/POOL_TRIM_RATIO未満の状態が
+#define POOL_TRIM_INTERVAL 10	// この時間(sec)続いたら未使用blockを解放する
+#if !defined IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define _WRITEV_IOV_NUM MIN(_PUSH_BUFFER_NUM_PAR_LOOP, IOV_MAX) // 一回のsendmsgでまとめるbuffer数
 
 #define BUFFER_SIZE NIO_BUFFER_SIZE		  // max recv buffer size
 #define RW_BUFFER_SIZE BUFFER_SIZE		  // read/write buffer size (per connection)
+#define WBUFFER_SMALL_SIZE 512			  // write buffer size (small)
+#define WBUFFER_MEDIUM_SIZE 8192		  // write buffer size (medium)
+#define WBUFFER_CLASS_NUM 3				  // write buffer size class数
+#define WBUFFER_CLASS_SHARED 3			  // write buffer : 共有payloadの参照（データ領域なし）
+#define WBUFFER_POOL_NUM 4				  // write buffer pool数(size class + 参照)
+#define RBUFFER_SMALL_SIZE 512			  // receive buffer size (small)
+#define RBUFFER_MEDIUM_SIZE 8192		  // receive buffer size (medium)
+#define RBUFFER_CLASS_NUM 3				  // receive buffer size class数
 #define SOCKET_RECV_BUFFER_SIZE 65536 * 4 // TCP recv buffer size
 #define SOCKET_SEND_BUFFER_SIZE 65536 * 4 // TCP send buffer size
-#define MESSAGE_HASH_SIZE 103			  // message hashsize
+#define READ_BUDGET_BYTES 65536 * 4		  // 1回のイベントで読み込むbyte数(default)
+#define READ_BUDGET_FRAMES 0			  // 1回のイベントで読み込むframe数(default, 0:制限なし)
+#define MAX_FRAME_SIZE 65536 * 256		  // 受信できる1 frameの最大長さ(default, 0:制限なし)
+#define ACCEPT_BUDGET 64				  // 1回のイベントでacceptする数(default, 0:制限なし)
+#define CLIENT_POOL_BACKOFF_MIN 100		  // client pool : 再接続までの時間(msec, 初回)
+#define CLIENT_POOL_BACKOFF_MAX 10000	  // client pool : 再接続までの時間(msec, 上限)
+#define REACTOR_POLL_TIMEOUT 10000		  // multi reactorのpolling間隔(usec)
+#define ASYNC_NODE_DATA_SIZE 512		  // async send : poolから確保する要求のデータ長さ上限
+#define ASYNC_NODE_NUM 64				  // async send : pool初期確保数
+#define RELAY_PIPE_SIZE 65536 * 4		  // pair relay : splice用pipeのサイズ
+#define RELAY_HIGH_WATERMARK 65536 * 4	  // pair relay : 中継先の送信待ちがこれを超えたら中継元の読み込みを止める
+#define RELAY_LOW_WATERMARK 65536		  // pair relay : 中継先の送信待ちがこれ以下になったら読み込みを再開する
+#if !defined NIO_RELAY_SPLICE
+#define NIO_RELAY_SPLICE 1 // pair relayにspliceを使う(0:常にrecv/sendでコピー)
+#endif
+
+// コネクションID : reactor番号(8bit) | block index(6bit) | block内index(18bit) | generation(32bit)
+// block内indexは_MAX_CONNECTION_NUM未満、blockはpoolが倍々に拡張されるので64未満に収まる
+#define CONN_ID_OFFSET_BITS 18 // block内index
+#define CONN_ID_BLOCK_BITS 6	// block index
+#define CONN_ID_REACTOR_SHIFT (32 + CONN_ID_BLOCK_BITS + CONN_ID_OFFSET_BITS) // reactor番号の位置
+#define MAX_REACTOR_NUM 256 // multi reactor : reactor数の上限(IDに入る数)
 
 // convert macro
 #define NETIO_TO_CONNECTION(conn, co, retval) \
@@ -83,13 +131,18 @@ static int NIO_DEBUG = 0; // debug flag
 		return retval;                \
 	tcp = (tcp_t *)in;
 
-#define CONN_CLEAR(conn)                             \
-	close(conn->soc);                                \
-	event_del(&(conn->event));                       \
-	tcp_t *__parent = (tcp_t *)conn->parent;         \
-	netio_tcp_delete_write_buffer(__parent, conn);   \
-	__purge_recv_buffer(__parent, &(conn->rbuffer)); \
-	conn->rbuffer.len = 0;                           \
+#define CONN_CLEAR(conn)                           \
+	close(conn->soc);                              \
+	event_del(&(conn->event));                     \
+	event_del(&(conn->wevent));                    \
+	tcp_t *__parent = (tcp_t *)conn->parent;       \
+	netio_tcp_delete_write_buffer(__parent, conn); \
+	__release_recv_buffer(__parent, conn);         \
+	__release_relay_pipe(conn);                    \
+	__unlink_pair(conn);                           \
+	__client_pool_detach(conn);                    \
+	conn->soc = -1;                                \
+	conn->generation++;                            \
 	pool_free(__parent->connection_a, conn);
 
 #define FREE(p)    \
@@ -103,30 +156,103 @@ static int NIO_DEBUG = 0; // debug flag
  * receive buffer */
 typedef struct _recv_buffer
 {
-	char data[BUFFER_SIZE];
-	int len;
+	char *data; // 受信データ領域（通常はbuffer、大きなframeの受信中は拡張領域）
+	int size;	// data領域のサイズ
+	int head;	// 未処理データの先頭位置
+	int len;	// 未処理データ長さ
+	int rclass; // size class
 
-	struct _recv_buffer *next;
+	char buffer[]; // 受信バッファ(size classの大きさ)
 } recv_buffer_t;
 
+/***************************
+ * shared payload (broadcastで複数のコネクションから参照するデータ) */
+typedef struct _shared_payload
+{
+	int refcount; // 参照しているwrite buffer数(netio_broadcast中はその分も含む)
+	int len;	  // データ長さ
+	char data[];
+} shared_payload_t;
+
+/***************************
+ * write_buffer_t */
+typedef struct _write_buffer
+{
+	struct _write_buffer *next; // 次のbuffer
+	int wclass;					// size class
+	int size;					// buffer領域サイズ
+	int buffer_len;				// 格納データ長さ
+	int offset;					// 送信済みデータ長さ
+	char *data;					// 送信データ(通常はbuffer、参照の場合はsharedのデータ)
+	shared_payload_t *shared;	// 参照している共有payload
+	char buffer[];
+} write_buffer_t;
+
+/***************************
+ * async send (他threadからの送信要求) */
+typedef struct _async_node
+{
+	struct _async_node *next; // next node
+	nio_conn_id id;			  // 送信先のコネクションID（reactorのthreadでコネクションに変換する）
+	int pooled;				  // async_aから確保したか
+	int len;				   // データ長さ
+	char data[];
+} async_node_t;
+
+/***************************
+ * client pool (常時接続しておくコネクション1本分) */
+typedef struct _client_pool_slot
+{
+	struct _tcp *cli;		  // 所属client
+	struct _connection *conn; // コネクション(再接続待ちの間はNULL)
+	int backoff;			  // 次に切断された時の再接続までの時間(msec)
+	struct event timer;		  // 再接続timer
+} client_pool_slot_t;
+
 /***************************
  * connection */
 typedef struct _connection
 {
-	int soc;			// socket
-	struct event event; // event
+	int soc;			 // socket
+	struct event event;	 // event
+	struct event wevent; // write event (書き込みバッファにデータがある間だけ登録)
+	int wevent_added;	 // write event登録済みflag
+
+	write_buffer_t *wtop;  // 書き込みバッファ（先頭）
+	write_buffer_t *wlast; // 書き込みバッファ（最後）
+	int wlen;			   // 書き込みバッファ使用量(byte)
 
 	close_callback close_func; // close callback function
 	recv_callback recv_func;   // receive callback function
 	parse_callback parse_func; // parse callback function
+	frame_callback frame_func; // frame parse callback function (zero copy)
 
 	recv_check_func rcheck_func; // receive check function
 
 	void *parent; // server or client
 
-	recv_buffer_t rbuffer; // receive buffer
+	recv_buffer_t *rbuffer;	 // receive buffer (parseしきれなかったデータがある間だけ確保)
+	unsigned int generation; // 切断毎に加算（callback内での切断・再利用の検出用）
 
-	struct _connection *pair; // pair connection
+	struct _connection *pair;	  // pair connection
+	unsigned int pair_generation; // pair設定時の中継先のgeneration（片方向pairの中継先の切断・再利用の検出用）
+	int pair_linked;			  // netio_conn_pairで相互に結ばれている
+	int read_paused;		  // pair relay : 中継先が詰まっているので読み込み停止中
+
+	int wm_low;					// 書き込みバッファ low watermark(byte)
+	int wm_high;				// 書き込みバッファ high watermark(byte, 0:無効)
+	int wm_limit;				// 書き込みバッファ上限(byte, 0:無効)。超えたら切断
+	watermark_callback wm_func; // watermark callback function
+	int wm_over;				// high watermarkを超えている間 1
+	int wm_shut;				// 上限を超えて切断待ちの間 1
+
+	int rpipe[2];	// pair relay : 送信待ちデータのpipe（pairから中継されるコネクション側に持つ）
+	int rpipe_len;	// pair relay : pipe内のデータ長さ
+	int rpipe_size; // pair relay : pipeのサイズ
+
+	int connecting;				  // client : 接続完了待ちの間 1（送信データはバッファにためる）
+	connect_callback connect_func; // client : connect callback function
+	client_pool_slot_t *pool_slot; // client : client poolのコネクションならそのslot
 
 	char conbuf[]; // connection buffer
 } connection_t;
@@ -138,6 +264,13 @@ typedef struct _server
 	connection_t listen_conn;	   // listen connection
 	accept_callback accept_func;   // accept callback function
 	accept_check_func acheck_func; // accept check function
+	int accept_budget;			   // 1回のイベントでacceptする数(0:制限なし)
+
+	struct _tcp *master;   // multi reactor : 親サーバ
+	struct _tcp **reactor; // multi reactor : reactor list
+	pthread_t *thread;	   // multi reactor : reactor thread
+	int n_reactor;		   // multi reactor : reactor数
+	int running;		   // multi reactor : 実行中flag(reactor threadから参照するので__atomicで読み書きする)
 } server_t;
 
 /***************************
@@ -150,8 +283,21 @@ typedef struct _client
 	close_callback close_func; // close callbck function
 	recv_callback recv_func;   // receive callback function
 	parse_callback parse_func; // parse callback function
+	frame_callback frame_func; // frame parse callback function (zero copy)
 
 	recv_check_func rcheck_func; // receive check function
+
+	int wm_low;					// 書き込みバッファ low watermark(byte)
+	int wm_high;				// 書き込みバッファ high watermark(byte, 0:無効)
+	int wm_limit;				// 書き込みバッファ上限(byte, 0:無効)
+	watermark_callback wm_func; // watermark callback function
+
+	connect_callback connect_func; // connect callback function
+	int connect_timeout;		   // 接続タイムアウト(msec, 0:なし)
+
+	client_pool_slot_t *pool; // client pool
+	int pool_num;			  // client pool : コネクション数
+	int pool_next;			  // client pool : 次に探し始める位置
 } client_t;
 
 /***************************
@@ -164,10 +310,26 @@ typedef struct _tcp
 	struct sockaddr_in addr;	   // server address info
 	struct event_base *event_base; // event base
 
-	struct event event; // timer event
+	int read_budget_bytes;	// 1回のイベントで読み込むbyte数(0:制限なし)
+	int read_budget_frames; // 1回のイベントで読み込むframe数(0:制限なし)
+	int max_frame_size;		// 受信できる1 frameの最大長さ(0:制限なし)
+
+	void *wbuffer_a[WBUFFER_POOL_NUM]; // write buffer pool (size class毎 + 参照)
+	void *rbuffer_a[RBUFFER_CLASS_NUM]; // receive buffer pool (size class毎)
 
-	void *wbuffer_m; // message list
-	void *rbuffer_a; // optional receive buffer
+	char *parsed_buffer;	// parse結果格納領域
+	int parsed_buffer_size; // parse結果格納領域サイズ
+
+	int async_fd;				// async send : wakeup用eventfd
+	struct event async_event;	// async send : wakeup event
+	async_node_t *async_head;	// async send : 要求list(lock free, 新しいものが先頭)
+	void *async_a;				// async send : 要求node pool(thread safe)
+
+	time_t rbuffer_low_time[RBUFFER_CLASS_NUM]; // 使用数が容量の1/POOL_TRIM_RATIO未満になった時刻(0:なっていない)
+	time_t wbuffer_low_time[WBUFFER_POOL_NUM];	// 使用数が容量の1/POOL_TRIM_RATIO未満になった時刻(0:なっていない)
+
+	unsigned int generation_seq; // コネクション確保毎に加算(コネクションIDのgeneration)
+	int reactor_index;			 // multi reactor : 親サーバでのreactor番号(コネクションIDに含める。それ以外は0)
 
 	union
 	{
@@ -179,129 +341,270 @@ typedef struct _tcp
 
 } tcp_t;
 
-/***************************
- * write_buffer_t */
-typedef struct _write_buffer
-{
-	nio_conn conn;
-	char buffer[RW_BUFFER_SIZE];
-	int buffer_len;
-} write_buffer_t;
-
 static struct event_base *event_base = NULL; // global event base
 
-static struct timeval timer_inteval = {.tv_sec = 0, .tv_usec = 1000};
+// write buffer size class
+static const int wbuffer_class_size[WBUFFER_POOL_NUM] = {WBUFFER_SMALL_SIZE, WBUFFER_MEDIUM_SIZE, RW_BUFFER_SIZE, 0};
+static const int wbuffer_class_num[WBUFFER_POOL_NUM] = {64, 16, 4, 64}; // 初期確保数
+static const int rbuffer_class_size[RBUFFER_CLASS_NUM] = {RBUFFER_SMALL_SIZE, RBUFFER_MEDIUM_SIZE, BUFFER_SIZE};
+static const int rbuffer_class_num[RBUFFER_CLASS_NUM] = {64, 16, 4}; // 初期確保数
 
 // static int netio_tcp_append_write_buffer(tcp_t *tcp, connection_t *c, const char *data, int len);
 static void netio_tcp_delete_write_buffer(tcp_t *tcp, connection_t *c);
-static int netio_tcp_push_write_buffer(nio_tcp tcp, int count);
+static int netio_tcp_push_write_buffer(connection_t *c, int count);
+static void __release_client_pool(tcp_t *cli);
+
+/**
+ * 受信バッファのsize classの選択
+ *
+ * @param int len : 格納するデータ長さ
+ * @return int : lenが収まる最小のsize class（収まらなければ最大のsize class）
+ */
+static inline int __recv_buffer_class(int len)
+{
+	int rclass = 0;
+	while ((rclass < RBUFFER_CLASS_NUM - 1) && (rbuffer_class_size[rclass] < len))
+	{
+		rclass++;
+	}
+	return rclass;
+}
+
+/**
+ * 受信バッファの初期化
+ *
+ * @param recv_buffer_t *rb : 受信バッファ
+ */
+static inline void __init_recv_buffer(recv_buffer_t *rb)
+{
+	rb->data = rb->buffer;
+	rb->size = rbuffer_class_size[rb->rclass];
+	rb->head = 0;
+	rb->len = 0;
+}
+
+/**
+ * 受信バッファのクリア
+ * （拡張領域を使用していれば解放する）
+ *
+ * @param recv_buffer_t *rb : 受信バッファ
+ */
+static void __clear_recv_buffer(recv_buffer_t *rb)
+{
+	if (rb->data != rb->buffer)
+	{
+		_PRINTF("%s : free extend buffer : (%p) %d\n", __func__, rb->data, rb->size);
+		FREE(rb->data);
+	}
+	__init_recv_buffer(rb);
+}
 
 /**
- * 受信バッファの使用サイズを得る
+ * 受信バッファの確保
  *
+ * @param tcp_t *tcp : tcp
  * @param connection_t *conn : コネクション
- * @return int : データ長さ（なければ0)
+ * @param int len : 格納するデータ長さ（これが収まるsize classから確保する）
+ * @return recv_buffer_t * : 受信バッファ（失敗:NULL）
  */
-static int __get_receive_buffer_len(connection_t *conn)
+static recv_buffer_t *__alloc_recv_buffer(tcp_t *tcp, connection_t *conn, int len)
 {
-	int len = 0;
-	recv_buffer_t *rb;
-	for (rb = &(conn->rbuffer); rb; rb = rb->next)
+	int rclass = __recv_buffer_class(len);
+	recv_buffer_t *rb = (recv_buffer_t *)pool_alloc(tcp->rbuffer_a[rclass]);
+	if (rb == NULL)
 	{
-		len += rb->len;
+		_PRINTF("%s : rbuffer_a[%d] pool_alloc failed\n", __func__, rclass);
+		return NULL;
 	}
-	return len;
+	rb->rclass = rclass;
+	__init_recv_buffer(rb);
+	conn->rbuffer = rb;
+	_PRINTF("%s : alloc : (%p) %p %d\n", __func__, conn, rb, rclass);
+	return rb;
 }
 
 /**
- * 未使用拡張受信バッファの削除
+ * 受信バッファの返却
  *
  * @param tcp_t *tcp : tcp
- * @param  recv_buffer_t *rb : 受信バッファ（これ以降のバッファを消す）
+ * @param connection_t *conn : コネクション
  */
-static void __purge_recv_buffer(tcp_t *tcp, recv_buffer_t *rb)
+static void __release_recv_buffer(tcp_t *tcp, connection_t *conn)
 {
+	recv_buffer_t *rb = conn->rbuffer;
 	if (rb == NULL)
 	{
 		return;
 	}
-	// 残りを消す
-	recv_buffer_t *delete_rb = rb->next;
-	while (delete_rb)
+	_PRINTF("%s : release : (%p) %p\n", __func__, conn, rb);
+	__clear_recv_buffer(rb);
+	pool_free(tcp->rbuffer_a[rb->rclass], rb);
+	conn->rbuffer = NULL;
+}
+
+/**
+ * 受信バッファの付け替え
+ * （未処理データを指定のsize classのバッファへ移す）
+ *
+ * @param tcp_t *tcp : tcp
+ * @param connection_t *conn : コネクション
+ * @param int rclass : 移動先のsize class
+ * @return recv_buffer_t * : 受信バッファ（失敗:NULL、元のバッファはそのまま）
+ */
+static recv_buffer_t *__move_recv_buffer(tcp_t *tcp, connection_t *conn, int rclass)
+{
+	recv_buffer_t *rb = conn->rbuffer;
+	recv_buffer_t *new_rb = (recv_buffer_t *)pool_alloc(tcp->rbuffer_a[rclass]);
+	if (new_rb == NULL)
 	{
-		recv_buffer_t *trb = delete_rb->next;
-		_PRINTF("%s : purge : (%p) %d\n", __func__, delete_rb, delete_rb->len);
-		delete_rb->len = 0;
-		delete_rb->next = NULL;
-		pool_free(tcp->rbuffer_a, delete_rb);
-		delete_rb = trb;
+		_PRINTF("%s : rbuffer_a[%d] pool_alloc failed\n", __func__, rclass);
+		return NULL;
 	}
-	rb->next = NULL;
+	new_rb->rclass = rclass;
+	__init_recv_buffer(new_rb);
+	memcpy(new_rb->data, rb->data + rb->head, rb->len);
+	new_rb->len = rb->len;
+	_PRINTF("%s : (%p) %p %d -> %p %d : %d\n", __func__, conn, rb, rb->rclass, new_rb, rclass, rb->len);
+
+	__clear_recv_buffer(rb);
+	pool_free(tcp->rbuffer_a[rb->rclass], rb);
+	conn->rbuffer = new_rb;
+	return new_rb;
 }
 
 /**
- * 受信バッファへの積み込み
+ * 受信バッファの空き領域の確保
  *
- * @param connection_t *conn : コネクション
- * @param  const char *data : 積み込むデータ
- * @param  int len : 積み込むデータ長さ
+ * 未処理データを先頭に詰めて(compaction)、後ろに空き領域を作る。
+ * 空きがない（1 frameがバッファより大きい）場合は、一つ大きいsize classへ移し、
+ * 最大のsize classでも足りなければ領域を倍に拡張する。
+ * 拡張はmax_sizeまで（相手が送ってくるframe長さで際限なく確保しないため）
  *
- * @return int : 成功：1 / 失敗：0
+ * @param tcp_t *tcp : tcp
+ * @param connection_t *conn : コネクション（受信バッファを持っていること）
+ * @param int max_size : 最大サイズ(0:制限なし)
+ * @return int : 空き領域の長さ（失敗:-ENOMEM / 最大サイズを超える:-EMSGSIZE）
  */
-static int __stack_recv_buffer(connection_t *conn, const char *data, int len)
+static int __reserve_recv_buffer(tcp_t *tcp, connection_t *conn, int max_size)
 {
-	tcp_t *tcp = conn->parent;
-	const char *pdata = data;
-	int last_len = len;
-
-	if (last_len == 0)
+	recv_buffer_t *rb = conn->rbuffer;
+	if (rb->len == 0)
 	{
-		// 入れるものはない
-		conn->rbuffer.len = 0;
-		__purge_recv_buffer(tcp, &(conn->rbuffer));
-		return 1;
+		rb->head = 0;
+	}
+	if (rb->head + rb->len < rb->size)
+	{
+		// 後ろに空きがある
+		return rb->size - (rb->head + rb->len);
+	}
+	if (rb->head > 0)
+	{
+		// 未処理データを先頭に詰める
+		memmove(rb->data, rb->data + rb->head, rb->len);
+		rb->head = 0;
+		return rb->size - rb->len;
 	}
 
-	recv_buffer_t *rb = &(conn->rbuffer);
-	int cplen = MIN(sizeof(rb->data), last_len);
-	// printf("%s : cplen = %d\n", __func__, cplen);
-	//  data copy
-	memcpy(rb->data, pdata, cplen);
-	rb->len = cplen;
-	// pointerをするめる
-	pdata += cplen;
-	last_len -= cplen;
-	// printf("%s : last_len = %d\n", __func__, last_len);
-	_PRINTF("%s : stuck buffer : %d %d\n", __func__, cplen, last_len);
-
-	while (last_len > 0)
+	// 満杯なので拡張する
+	if ((rb->size > INT_MAX / 2) || ((max_size > 0) && (rb->size >= max_size)))
 	{
-		// printf("%s : last_len(loop) = %d\n", __func__, last_len);
-		if (rb->next == NULL)
+		_PRINTF("%s : recv buffer too large : %d\n", __func__, rb->size);
+		return -EMSGSIZE;
+	}
+	if ((rb->data == rb->buffer) && (rb->rclass < RBUFFER_CLASS_NUM - 1) &&
+		((max_size <= 0) || (rbuffer_class_size[rb->rclass + 1] <= max_size)))
+	{
+		// 大きいsize classへ移す
+		rb = __move_recv_buffer(tcp, conn, rb->rclass + 1);
+		if (rb == NULL)
 		{
-			rb->next = (recv_buffer_t *)pool_alloc(tcp->rbuffer_a);
-			if (rb == NULL)
-			{
-				_PRINTF("%s : rbuffer_a pool_alloc failed\n", __func__);
-				return 0;
-			}
-			rb->next->len = 0;
-			rb->next->next = NULL;
-			rb = rb->next;
-			_PRINTF("%s : alloc : (%p) %d\n", __func__, rb, last_len);
+			return -ENOMEM;
 		}
+		return rb->size - rb->len;
+	}
+	int new_size = rb->size * 2;
+	if ((max_size > 0) && (new_size > max_size))
+	{
+		new_size = max_size;
+	}
+	char *new_data = (char *)malloc(new_size);
+	if (new_data == NULL)
+	{
+		_PRINTF("%s : extend buffer alloc failed : %d\n", __func__, new_size);
+		return -ENOMEM;
+	}
+	memcpy(new_data, rb->data, rb->len);
+	if (rb->data != rb->buffer)
+	{
+		free(rb->data);
+	}
+	_PRINTF("%s : extend buffer : (%p) %d -> %d\n", __func__, new_data, rb->size, new_size);
+	rb->data = new_data;
+	rb->size = new_size;
 
-		int cplen = MIN(sizeof(rb->data), last_len);
-		// data copy
-		memcpy(rb->data, pdata, cplen);
-		rb->len = cplen;
-		// pointerをするめる
-		pdata += cplen;
-		last_len -= cplen;
-		// printf("%s : last_len(loop end) = %d\n", __func__, last_len);
+	return rb->size - rb->len;
+}
+
+/**
+ * 受信バッファの縮小
+ *
+ * 未処理データが収まる最小のsize classへ移す（拡張領域を使っていれば通常バッファに戻す）。
+ * 受信が一段落した時に呼び、部分frameを保持したまま待つコネクションが大きなバッファを持たないようにする
+ *
+ * @param tcp_t *tcp : tcp
+ * @param connection_t *conn : コネクション
+ */
+static void __shrink_recv_buffer(tcp_t *tcp, connection_t *conn)
+{
+	recv_buffer_t *rb = conn->rbuffer;
+	if (rb == NULL)
+	{
+		return;
+	}
+	int rclass = __recv_buffer_class(rb->len);
+	if (rb->len > rbuffer_class_size[rclass])
+	{
+		// 拡張領域でないと収まらない
+		return;
+	}
+	if (rclass < rb->rclass)
+	{
+		// 失敗しても今のバッファをそのまま使う
+		__move_recv_buffer(tcp, conn, rclass);
+		return;
+	}
+	if (rb->data != rb->buffer)
+	{
+		char *ext = rb->data;
+		memcpy(rb->buffer, ext + rb->head, rb->len);
+		free(ext);
+		rb->data = rb->buffer;
+		rb->size = rbuffer_class_size[rb->rclass];
+		rb->head = 0;
 	}
-	__purge_recv_buffer(tcp, rb); // 現在よりも後のデータを消す
+}
 
+/**
+ * parse結果格納領域の確保
+ *
+ * @param tcp_t *tcp : tcp
+ * @param int len : 必要な長さ
+ * @return int : 成功：1 / 失敗：0
+ */
+static int __reserve_parsed_buffer(tcp_t *tcp, int len)
+{
+	if (len <= tcp->parsed_buffer_size)
+	{
+		return 1;
+	}
+	char *p = (char *)realloc(tcp->parsed_buffer, len);
+	if (p == NULL)
+	{
+		_PRINTF("%s : parsed_buffer alloc failed : %d\n", __func__, len);
+		return 0;
+	}
+	tcp->parsed_buffer = p;
+	tcp->parsed_buffer_size = len;
 	return 1;
 }
 
@@ -309,84 +612,68 @@ static int __stack_recv_buffer(connection_t *conn, const char *data, int len)
 /**
  * パーサ設定時の受信バッファ処理.
  *
+ * 受信データをそのままparseする。
+ * コネクションが受信バッファを持っている場合は、受信データはその中に直接読み込まれている。
+ * parseしきれなかった残りだけを受信バッファに保持し、なくなったら受信バッファは返却する。
+ * frame_funcが設定されている場合はコピーせず、受信データ上のframeをrecv_funcに渡す。
+ *
  * @param connection_t *conn [in] : コネクション
- * @param  char *data [in] :受信データ
+ * @param  char *data [in] :受信データ（受信バッファに読み込んだ場合はNULL）
  * @param  int len [in] :受信データ長さ
- * @return int : 成功:受信データ長さ 失敗:< 0
+ * @param  int *n_frame [out] :recv_funcに渡したframe数
+ * @return int : 成功:未処理データ長さ 失敗:-errno（-EBADMSG:parse失敗 / -ENOMEM:受信バッファ確保失敗）
  */
-static inline int __parse_receive(connection_t *conn, char *data, int len)
+static inline int __parse_receive(connection_t *conn, char *data, int len, int *n_frame)
 {
-	char *pdata = NULL;
-	char *databuffer = NULL;
-	int n_data = 0;
+	tcp_t *tcp = (tcp_t *)conn->parent;
+	recv_buffer_t *rb = conn->rbuffer;
+	unsigned int generation = conn->generation;
 
-	if (conn->parse_func == NULL)
+	if ((conn->parse_func == NULL) && (conn->frame_func == NULL))
 	{
-		return -1; // safety
+		return -EINVAL; // safety
 	}
 
-	int erb_len = __get_receive_buffer_len(conn);
-	int databuffer_len = len + erb_len + 1; // +1はtextの時の'\0'の分を確保
-	if (erb_len > 0)
-	{
-		// 保存してあるデータを読み込む
-
-		char *databuffer = (char *)malloc(databuffer_len);
-		if (databuffer == NULL)
-		{
-			_PRINTF("%s : databuffer alloc failed : %d\n", __func__, databuffer_len);
-			assert(0);
-			return -1; // safety
-		}
-
-		// printf("%s : erb_len = %d\n", __func__, erb_len);
-		pdata = databuffer;
-		n_data = 0;
-
-		// rbufferのデータを積む
-		int tmplen = 0;
-		recv_buffer_t *rb;
-		for (rb = &(conn->rbuffer); rb; rb = rb->next)
-		{
-			// printf("%s : rb->len = %d\n", __func__, rb->len);
-			memcpy(pdata + tmplen, rb->data, rb->len);
-			tmplen += rb->len;
-		}
-		// 今回のデータを改めて積む
-		memcpy(pdata + tmplen, data, len);
-
-		n_data = len + erb_len; // 合計長
-		pdata = databuffer;
-
-		__purge_recv_buffer(conn->parent, &(conn->rbuffer));
-		conn->rbuffer.len = 0;
-	}
-	else
+	char *pdata = data;
+	int n_data = len;
+	if (rb != NULL)
 	{
-		pdata = data;
-		n_data = len;
+		pdata = rb->data + rb->head;
+		n_data = rb->len;
 	}
-	// printf("%s : len = %d\n", __func__, n_data);
 
-	char *parsed_data = (char *)malloc(databuffer_len);
-	if (parsed_data == NULL)
+	// +1はtextの時の'\0'の分を確保
+	if ((conn->frame_func == NULL) && !__reserve_parsed_buffer(tcp, n_data + 1))
 	{
-		FREE(databuffer);
-		_PRINTF("%s : parsed_data alloc failed : %d\n", __func__, databuffer_len);
 		assert(0);
-		return -1;
+		return -ENOMEM;
 	}
+
 	while (n_data > 0)
 	{
-		int parsed_len = databuffer_len;
-		int read_len = conn->parse_func(pdata, n_data, parsed_data, &parsed_len);
+		char *frame = NULL;
+		int frame_len = 0;
+		int read_len = 0;
+
+		if (conn->frame_func != NULL)
+		{
+			// frameの位置だけ受け取る
+			int frame_offset = 0;
+			read_len = conn->frame_func(pdata, n_data, &frame_offset, &frame_len);
+			frame = pdata + frame_offset;
+		}
+		else
+		{
+			frame_len = tcp->parsed_buffer_size;
+			read_len = conn->parse_func(pdata, n_data, tcp->parsed_buffer, &frame_len);
+			frame = tcp->parsed_buffer;
+		}
 		if (read_len < 0)
 		{
-			// 何らかのエラー
-			_PRINTF("%s : parse_func failed : %d : %d %d\n", __func__, parsed_len, n_data, (int)databuffer_len);
-			FREE(databuffer);
-			FREE(parsed_data);
-			return read_len;
+			// 何らかのエラー（以降のデータは読めないので捨てる）
+			_PRINTF("%s : parse failed : %d : %d\n", __func__, frame_len, n_data);
+			__release_recv_buffer(tcp, conn);
+			return -EBADMSG;
 		}
 		else if (read_len == 0)
 		{
@@ -394,181 +681,478 @@ static inline int __parse_receive(connection_t *conn, char *data, int len)
 			break;
 		}
 
+		pdata += read_len;
+		n_data -= read_len;
+		if (rb != NULL)
+		{
+			rb->head += read_len;
+			rb->len -= read_len;
+		}
+
+		// 受信データはcallbackが戻るまで移動しないので、frameはそのまま渡せる
+		(*n_frame)++;
 		if (conn->recv_func != NULL)
 		{
-			conn->recv_func(conn, parsed_data, parsed_len);
+			conn->recv_func(conn, frame, frame_len);
+			if (conn->generation != generation)
+			{
+				// callback内で切断された
+				return 0;
+			}
 		}
-		n_data -= read_len;
-		pdata += read_len;
 	}
-	// printf("%s : n_data = %d\n", __func__, n_data);
 
-	if (n_data > 0)
+	if (n_data == 0)
+	{
+		// 全て処理した
+		__release_recv_buffer(tcp, conn);
+		return 0;
+	}
+
+	if (rb == NULL)
 	{
-		// 残りを受信バッファに戻す
-		if (!__stack_recv_buffer(conn, pdata, n_data))
+		// 残りを受信バッファに保持する
+		rb = __alloc_recv_buffer(tcp, conn, n_data);
+		if (rb == NULL)
 		{
-			_PRINTF("%s : recv buffer too short : %d\n", __func__, n_data);
-			assert(0);
-			FREE(databuffer);
-			FREE(parsed_data);
-			return -2;
+			_PRINTF("%s : recv buffer alloc failed : %d\n", __func__, n_data);
+			return -ENOMEM;
 		}
+		memcpy(rb->data, pdata, n_data);
+		rb->len = n_data;
 	}
 
-	FREE(databuffer);
-	FREE(parsed_data);
 	return n_data;
 }
 
 /**
- * タイマーイベント処理.
+ * write eventの登録
  *
- * @param int soc [in] : イベント発生descriptor（未使用）
- * @param short events [in] : 発生イベント種類（未使用）
- * @param void *user_data [in] : ユーザ設定データ：tcp_t構造体へのポインタ
+ * @param connection_t *c [in] : コネクション
  */
-static void __timer_event_callback(int soc, short events, void *user_data)
+static inline void __enable_write_event(connection_t *c)
 {
-	tcp_t *t = (tcp_t *)user_data;
-
-	int r = 0;
-	if (t->wbuffer_m != NULL)
+	if (!c->wevent_added)
 	{
-		r = netio_tcp_push_write_buffer(t, _PUSH_BUFFER_NUM_PAR_LOOP);
+		event_add(&(c->wevent), NULL);
+		c->wevent_added = 1;
 	}
+}
 
-	static struct timeval ti = {.tv_sec = 0, .tv_usec = 500000};
-	if (r > 0)
+/**
+ * write eventの解除
+ *
+ * @param connection_t *c [in] : コネクション
+ */
+static inline void __disable_write_event(connection_t *c)
+{
+	if (c->wevent_added)
 	{
-		ti = timer_inteval;
+		event_del(&(c->wevent));
+		c->wevent_added = 0;
 	}
-	evtimer_add(&(t->event), &ti);
 }
 
 /**
- * 読み込みイベント処理
+ * pair relay : 中継元の読み込み停止
  *
- * @param int soc [in] : イベント発生ソケット
- * @param short events [in] : 発生イベント種類
- * @param void *user_data [in] : ユーザ設定データ：connection_t構造体へのポインタ
+ * @param connection_t *c [in] : 中継元コネクション
  */
-static void __read_event_callback(int soc, short events, void *user_data)
+static inline void __pause_relay_read(connection_t *c)
 {
-	int ret = -1;
-	char buff[BUFFER_SIZE];
-
-	connection_t *conn = (connection_t *)user_data;
-	tcp_t *sv = NULL;
-
-	if (conn->rcheck_func != NULL)
+	if (!c->read_paused)
 	{
-		// 受信可否チェック関数が指定されている
-		if (conn->rcheck_func(conn) < 0)
-		{
-			// 受信可能ではないので何もしない
-			return; // recvを呼び出していないので、kernelの受信バッファにたまる
-		}
+		event_del(&(c->event));
+		c->read_paused = 1;
 	}
+}
 
-	if (!(events & EV_READ))
+/**
+ * pair relay : 中継元の読み込み再開
+ *
+ * @param connection_t *c [in] : 中継元コネクション
+ */
+static inline void __resume_relay_read(connection_t *c)
+{
+	if (c->read_paused)
 	{
-		// READ eventではない
-		_PRINTF("%s : event = 0x%X\n", __func__, events);
-		return;
+		event_add(&(c->event), NULL);
+		c->read_paused = 0;
 	}
+}
 
-	sv = (tcp_t *)conn->parent;
-
-	ret = recv(soc, buff, sizeof(buff), MSG_NOSIGNAL);
-	if (ret == 0)
-	{
-		// 切断
-		if (conn->close_func != NULL)
-		{
-			// close callback が指定されていたらcallbackを呼び出す
-			conn->close_func(conn, 0);
-		}
-		CONN_CLEAR(conn);
-		_PRINTF("connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
-		return;
-	}
-	else if (ret < 0)
+/**
+ * 書き込みバッファ使用量のwatermarkチェック
+ *
+ * 使用量が変化した後に呼ぶ。
+ * high watermarkを超えた時、その後low watermark以下に戻った時にそれぞれ1回だけcallbackを呼ぶ。
+ * 上限を超えた場合はバッファを捨ててshutdownする。
+ * 送信処理の途中(他コネクションのscan中やpairへの中継中等)で呼ばれるため、ここではコネクションを解放せず、
+ * 切断は受信イベントで行う（close callbackにはENOBUFSが渡される）
+ *
+ * @param connection_t *c [in] : コネクション
+ * @return int : 0:継続 / -1:上限を超えたので切断
+ */
+static int __check_watermark(connection_t *c)
+{
+	if ((c->wm_limit > 0) && (c->wlen > c->wm_limit))
 	{
-		// エラー
-		if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR))
-		{
-			// 後でもう一度呼ぶ
-			return;
-		}
-		// 上記以外のエラー
-		_PRINTF("%s : read failed : %d\n", __func__, errno);
-		if (conn->close_func != NULL)
+		_PRINTF("%s : write buffer limit over : %p %d / %d\n", __func__, c, c->wlen, c->wm_limit);
+		netio_tcp_delete_write_buffer((tcp_t *)c->parent, c);
+		if (!c->connecting)
 		{
-			// close callback が指定されていたらcallbackを呼び出す
-			conn->close_func(conn, errno);
+			__disable_write_event(c); // 接続中は接続完了の検知に使っている
 		}
-		CONN_CLEAR(conn);
-		_PRINTF("connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
-		return;
+		shutdown(c->soc, SHUT_RDWR); // 受信イベントを発生させる
+		c->wm_shut = 1;
+		__resume_relay_read(c); // pair relayの中継元として読み込みを止めていても、受信イベントで切断されるように
+		return -1;
 	}
-	else
+
+	if (!c->wm_over)
 	{
-		// Pairへの送信
-		if (conn->pair != NULL)
-		{
-			int r = netio_sender(conn->pair, buff, ret);
-			_PRINTF("relay[%d](%d) : %d\n", soc, ret, r);
-			return;
-		}
-		// 通常処理
-		if (conn->parse_func != NULL)
+		if ((c->wm_high > 0) && (c->wlen > c->wm_high))
 		{
-			// parce functionが指定されている
-			if (__parse_receive(conn, buff, ret) < 0)
+			c->wm_over = 1;
+			if (c->wm_func != NULL)
 			{
-				_PRINTF("%s : parse_func failed : %d %d\n", __func__, soc, ret);
+				c->wm_func(c, NIO_WATERMARK_HIGH);
 			}
 		}
-		else if (conn->recv_func != NULL)
-		{
-			// recv callbackが指定されていたらcallbackを呼び出す
-			conn->recv_func(conn, buff, ret);
-		}
-		else
+	}
+	else if (c->wlen <= c->wm_low)
+	{
+		c->wm_over = 0;
+		if (c->wm_func != NULL)
 		{
-			_PRINTF("read[%d](%d)=%s\n", soc, ret, buff);
+			c->wm_func(c, NIO_WATERMARK_LOW);
 		}
 	}
+	return 0;
 }
 
 /**
- * acceptイベント処理
+ * pair relay用pipeの作成
  *
- * @param int soc [in] : イベント発生ソケット
- * @param short events [in] : 発生イベント種類
- * @param void *user_data [in] : ユーザ設定データ：tcp_t構造体へのポインタ
+ * @param connection_t *c [in] : 中継先コネクション
+ * @return int : 成功:1 / 失敗:0
  */
-static void __accept_event_callback(int event_soc, short events, void *user_data)
+static int __open_relay_pipe(connection_t *c)
 {
-	socklen_t addr_len;
-	struct sockaddr_in caddr;
-	int soc = 1;
-	connection_t *conn = NULL;
-	tcp_t *sv = (tcp_t *)user_data;
-
-	if (sv->server.acheck_func != NULL)
+	if (pipe2(c->rpipe, O_NONBLOCK | O_CLOEXEC) < 0)
 	{
-		// accept可否チェック関数が指定されている
-		if (sv->server.acheck_func(sv) < 0)
-		{
-			// acceptできる状態ではない
-			return;
-		}
+		_PRINTF("%s : pipe2 failed : %d\n", __func__, errno);
+		c->rpipe[0] = -1;
+		c->rpipe[1] = -1;
+		return 0;
 	}
+	fcntl(c->rpipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE); // 失敗してもdefaultのサイズで使う
+	c->rpipe_size = fcntl(c->rpipe[1], F_GETPIPE_SZ);
+	if (c->rpipe_size <= 0)
+	{
+		c->rpipe_size = 65536;
+	}
+	c->rpipe_len = 0;
+	return 1;
+}
+
+/**
+ * pair relay用pipeの解放
+ *
+ * @param connection_t *c [in]
+ */
+static inline void __release_relay_pipe(connection_t *c)
+{
+	if (c->rpipe[0] >= 0)
+	{
+		close(c->rpipe[0]);
+		close(c->rpipe[1]);
+		c->rpipe[0] = -1;
+		c->rpipe[1] = -1;
+	}
+	c->rpipe_len = 0;
+}
+
+/**
+ * pair relay : socketからpairのpipeへの移動
+ *
+ * pairの書き込みバッファにデータがある(順序が崩れる)場合や、pipeが使えない場合は何もしない。
+ * その場合はrecv/netio_senderでコピーして中継する
+ *
+ * @param connection_t *conn [in] : 中継元コネクション
+ * @param connection_t *dst [in] : 中継先コネクション
+ * @param int len [in] : 最大移動量
+ * @param int *ret [out] : recvと同じ意味の戻り値(移動したbyte数, 0:切断, -1:エラー(errno))
+ * @return int : 1:spliceした / 0:コピーで中継すること
+ */
+static int __splice_relay(connection_t *conn, connection_t *dst, int len, int *ret)
+{
+	if ((dst->wtop != NULL) || dst->connecting)
+	{
+		// pipeより後に送るデータがある(接続中ならバッファにためる)
+		return 0;
+	}
+	if ((dst->rpipe[0] < 0) && !__open_relay_pipe(dst))
+	{
+		return 0;
+	}
+	int room = dst->rpipe_size - dst->rpipe_len;
+	if (room <= 0)
+	{
+		// pipeがいっぱい
+		return 0;
+	}
+
+	int n = splice(conn->soc, NULL, dst->rpipe[1], NULL, MIN(len, room), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0)
+	{
+		if ((errno == EAGAIN) && (dst->rpipe_len > 0))
+		{
+			// pipe側が詰まっている可能性がある(socket側と区別できないのでrecvで確認する)
+			return 0;
+		}
+		if ((errno == EINVAL) || (errno == ENOSYS))
+		{
+			// splice非対応
+			return 0;
+		}
+	}
+	else
+	{
+		dst->rpipe_len += n;
+	}
+	*ret = n;
+	return 1;
+}
+
+/**
+ * pair relay : pipeからsocketへの送信
+ *
+ * 送りきれなければwrite eventを登録する
+ *
+ * @param connection_t *c [in] : 中継先コネクション
+ * @return int : 1:送りきった / 0:残っている / -1:エラー
+ */
+static int __flush_relay_pipe(connection_t *c)
+{
+	while (c->rpipe_len > 0)
+	{
+		int n = splice(c->rpipe[0], NULL, c->soc, NULL, c->rpipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			{
+				// 書き込み可能になったら送る
+				__enable_write_event(c);
+				return 0;
+			}
+			// もう送れないので捨てる（切断は受信側で検知する）
+			_PRINTF("%s : splice failed : %p %d\n", __func__, c, errno);
+			__release_relay_pipe(c);
+			netio_tcp_delete_write_buffer((tcp_t *)c->parent, c);
+			__disable_write_event(c);
+			return -1;
+		}
+		c->rpipe_len -= n;
+	}
+	return 1;
+}
+
+/**
+ * pair relay : 中継先の取得
+ *
+ * 片方向のpair(netio_conn_set_pair_connection)は中継先の切断を知らされないので、
+ * 設定時のgenerationと比べ、切断(再利用)されていればpairを外す
+ * （別のコネクションに中継しないように）
+ *
+ * @param connection_t *c [in] : 中継元コネクション
+ * @return connection_t * : 中継先（なければNULL）
+ */
+static inline connection_t *__relay_pair(connection_t *c)
+{
+	connection_t *p = c->pair;
+	if ((p != NULL) && !c->pair_linked && ((p->soc < 0) || (p->generation != c->pair_generation)))
+	{
+		_PRINTF("%s : pair closed : %p %p\n", __func__, c, p);
+		c->pair = NULL;
+		return NULL;
+	}
+	return p;
+}
+
+/**
+ * netio_conn_pairで結んだコネクションの解除
+ *
+ * 相手側の参照も消し、読み込みを止めていれば再開する。
+ * 片方向のpair(netio_conn_set_pair_connection)は相手が解放済みの場合があるので触らない
+ *
+ * @param connection_t *c [in]
+ */
+static void __unlink_pair(connection_t *c)
+{
+	if (!c->pair_linked)
+	{
+		return;
+	}
+	connection_t *p = c->pair;
+	p->pair = NULL;
+	p->pair_linked = 0;
+	__resume_relay_read(p);
+	c->pair = NULL;
+	c->pair_linked = 0;
+}
+
+/**
+ * client pool : 再接続timerの登録
+ *
+ * 再接続までの時間は失敗する毎に倍にする(接続できたら戻す)
+ *
+ * @param client_pool_slot_t *slot [in]
+ */
+static void __client_pool_schedule(client_pool_slot_t *slot)
+{
+	struct timeval tv;
+	tv.tv_sec = slot->backoff / 1000;
+	tv.tv_usec = (slot->backoff % 1000) * 1000;
+	evtimer_add(&(slot->timer), &tv);
+	slot->backoff = MIN(slot->backoff * 2, CLIENT_POOL_BACKOFF_MAX);
+}
+
+/**
+ * client pool : コネクション解放時の処理
+ *
+ * client poolのコネクションなら、slotを空けて再接続を予約する
+ *
+ * @param connection_t *c [in]
+ */
+static void __client_pool_detach(connection_t *c)
+{
+	client_pool_slot_t *slot = c->pool_slot;
+	if (slot == NULL)
+	{
+		return;
+	}
+	c->pool_slot = NULL;
+	slot->conn = NULL;
+	__client_pool_schedule(slot);
+}
+
+/**
+ * client 接続完了(または失敗)の処理
+ *
+ * 成功したら受信を開始し、connect callbackを呼んでから、接続中にためたデータを送る。
+ * 失敗・タイムアウトしたらconnect callback(未設定ならclose callback)を呼んで解放する
+ *
+ * @param connection_t *conn [in]
+ * @param short events [in] : EV_WRITE / EV_TIMEOUT
+ */
+static void __connect_event(connection_t *conn, short events)
+{
+	int err = ETIMEDOUT;
+	if (events & EV_WRITE)
+	{
+		socklen_t len = sizeof(err);
+		if (getsockopt(conn->soc, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		{
+			err = errno;
+		}
+	}
+	// タイムアウト付きで登録しているので一旦解除する
+	__disable_write_event(conn);
+
+	if (err != 0)
+	{
+		_PRINTF("%s : connect failed : %p %d\n", __func__, conn, err);
+		if (conn->connect_func != NULL)
+		{
+			conn->connect_func(conn, err);
+		}
+		else if (conn->close_func != NULL)
+		{
+			conn->close_func(conn, err);
+		}
+		CONN_CLEAR(conn);
+		return;
+	}
+
+	conn->connecting = 0;
+	event_add(&(conn->event), NULL);
+	if (conn->pool_slot != NULL)
+	{
+		// 接続できたので再接続の間隔を戻す
+		conn->pool_slot->backoff = CLIENT_POOL_BACKOFF_MIN;
+	}
+	if (conn->connect_func != NULL)
+	{
+		unsigned int generation = conn->generation;
+		conn->connect_func(conn, 0);
+		if (conn->generation != generation)
+		{
+			// callback内で切断された
+			return;
+		}
+	}
+	if ((conn->wtop != NULL) || (conn->rpipe_len > 0))
+	{
+		// 接続中にためたデータを送る
+		__enable_write_event(conn);
+	}
+}
+
+/**
+ * 書き込みイベント処理.
+ *
+ * 書き込みバッファにデータがあるコネクションが書き込み可能になったら呼ばれる
+ *
+ * @param int soc [in] : イベント発生ソケット
+ * @param short events [in] : 発生イベント種類
+ * @param void *user_data [in] : ユーザ設定データ：connection_t構造体へのポインタ
+ */
+static void __write_event_callback(int soc, short events, void *user_data)
+{
+	connection_t *conn = (connection_t *)user_data;
+
+	if (conn->connecting)
+	{
+		// 接続完了 or タイムアウト
+		__connect_event(conn, events);
+		return;
+	}
+
+	if (!(events & EV_WRITE))
+	{
+		// WRITE eventではない
+		_PRINTF("%s : event = 0x%X\n", __func__, events);
+		return;
+	}
+
+	netio_tcp_push_write_buffer(conn, _PUSH_BUFFER_NUM_PAR_LOOP);
+	if (conn->pair_linked && conn->pair->read_paused && (conn->wlen + conn->rpipe_len <= RELAY_LOW_WATERMARK))
+	{
+		// はけたので中継元の読み込みを再開
+		__resume_relay_read(conn->pair);
+	}
+	__check_watermark(conn);
+}
+
+/**
+ * 読み込みイベント処理
+ *
+ * EAGAINになるか、tcpに設定された読み込み量(byte数/frame数)に達するまで読み込む。
+ * 読み残した分は次のイベントで読む（他のコネクションを待たせないため）
+ *
+ * @param int soc [in] : イベント発生ソケット
+ * @param short events [in] : 発生イベント種類
+ * @param void *user_data [in] : ユーザ設定データ：connection_t構造体へのポインタ
+ */
+static void __read_event_callback(int soc, short events, void *user_data)
+{
+	int ret = -1;
+	char buff[BUFFER_SIZE];
+
+	connection_t *conn = (connection_t *)user_data;
+	tcp_t *sv = NULL;
 
-	_PRINTF("accept event callback\n");
-
 	if (!(events & EV_READ))
 	{
 		// READ eventではない
@@ -576,49 +1160,291 @@ static void __accept_event_callback(int event_soc, short events, void *user_data
 		return;
 	}
 
-	addr_len = sizeof(struct sockaddr_in);
-	if ((soc = accept(event_soc, (struct sockaddr *)&caddr, &addr_len)) == -1)
+	sv = (tcp_t *)conn->parent;
+	if (conn->wm_shut)
 	{
-		_PRINTF("%s : accept failed : %s(%d) \n", __func__, strerror(errno), errno);
+		// 書き込みバッファの上限を超えたので切断
+		if (conn->close_func != NULL)
+		{
+			conn->close_func(conn, ENOBUFS);
+		}
+		CONN_CLEAR(conn);
+		_PRINTF("connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
 		return;
 	}
 
-	conn = (connection_t *)pool_alloc(sv->connection_a);
+	unsigned int generation = conn->generation;
+	int total_len = 0;
+	int total_frame = 0;
+
+	while (1)
+	{
+		char *rbuff = buff;
+		int rlen = sizeof(buff);
+
+		if (conn->rcheck_func != NULL)
+		{
+			// 受信可否チェック関数が指定されている
+			if (conn->rcheck_func(conn) < 0)
+			{
+				// 受信可能ではないので何もしない
+				return; // recvを呼び出していないので、kernelの受信バッファにたまる
+			}
+		}
+
+		connection_t *pair = __relay_pair(conn);
+		if ((pair == NULL) && (conn->rbuffer != NULL))
+		{
+			// parseしきれていないデータがあるので、続きは受信バッファへ直接読み込む
+			rlen = __reserve_recv_buffer(sv, conn, sv->max_frame_size);
+			if (rlen <= 0)
+			{
+				_PRINTF("%s : recv buffer reserve failed : %d %d\n", __func__, soc, rlen);
+				if (conn->close_func != NULL)
+				{
+					conn->close_func(conn, (rlen < 0) ? -rlen : ENOMEM); // ENOMEM / EMSGSIZE
+				}
+				CONN_CLEAR(conn);
+				return;
+			}
+			rbuff = conn->rbuffer->data + conn->rbuffer->head + conn->rbuffer->len;
+		}
+
+		int spliced = 0;
+		if ((pair != NULL) && NIO_RELAY_SPLICE)
+		{
+			// pairへはユーザ空間を通さずに中継する
+			spliced = __splice_relay(conn, pair, rlen, &ret);
+		}
+		if (!spliced)
+		{
+			ret = recv(soc, rbuff, rlen, MSG_NOSIGNAL);
+		}
+		if (ret == 0)
+		{
+			// 切断
+			if (conn->close_func != NULL)
+			{
+				// close callback が指定されていたらcallbackを呼び出す
+				conn->close_func(conn, 0);
+			}
+			CONN_CLEAR(conn);
+			_PRINTF("connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
+			return;
+		}
+		else if (ret < 0)
+		{
+			// エラー
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR))
+			{
+				// 後でもう一度呼ぶ
+				return;
+			}
+			// 上記以外のエラー
+			_PRINTF("%s : read failed : %d\n", __func__, errno);
+			if (conn->close_func != NULL)
+			{
+				// close callback が指定されていたらcallbackを呼び出す
+				conn->close_func(conn, errno);
+			}
+			CONN_CLEAR(conn);
+			_PRINTF("connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
+			return;
+		}
+
+		if (pair != NULL)
+		{
+			// Pairへの送信
+			int r = spliced ? __flush_relay_pipe(pair) : netio_sender(pair, buff, ret);
+			_PRINTF("relay[%d](%d) : %d %d\n", soc, ret, r, spliced);
+		}
+		else if ((conn->parse_func != NULL) || (conn->frame_func != NULL))
+		{
+			// parce functionが指定されている
+			if (conn->rbuffer != NULL)
+			{
+				conn->rbuffer->len += ret;
+				rbuff = NULL;
+			}
+			int n_frame = 0;
+			int parsed = __parse_receive(conn, rbuff, ret, &n_frame);
+			if (parsed < 0)
+			{
+				// 続きのデータがframeの先頭として読まれないように切断する
+				_PRINTF("%s : parse_func failed : %d %d %d\n", __func__, soc, ret, parsed);
+				if (conn->close_func != NULL)
+				{
+					conn->close_func(conn, -parsed); // EBADMSG / ENOMEM
+				}
+				CONN_CLEAR(conn);
+				return;
+			}
+			total_frame += n_frame;
+		}
+		else if (conn->recv_func != NULL)
+		{
+			// recv callbackが指定されていたらcallbackを呼び出す
+			conn->recv_func(conn, buff, ret);
+			total_frame++;
+		}
+		else
+		{
+			_PRINTF("read[%d](%d)=%s\n", soc, ret, buff);
+		}
+
+		if (conn->generation != generation)
+		{
+			// callback内で切断された
+			return;
+		}
+		if (conn->pair_linked && (conn->pair->wlen + conn->pair->rpipe_len > RELAY_HIGH_WATERMARK))
+		{
+			// 中継先が詰まっているので、はけるまで読み込みを止める
+			__pause_relay_read(conn);
+			return;
+		}
+
+		total_len += ret;
+		if (ret < rlen)
+		{
+			// kernelの受信バッファは空になった（次の受信まで残りのframeを小さいバッファで待つ）
+			__shrink_recv_buffer(sv, conn);
+			return;
+		}
+		if ((sv->read_budget_bytes > 0) && (total_len >= sv->read_budget_bytes))
+		{
+			// 今回の読み込み量に達した
+			return;
+		}
+		if ((sv->read_budget_frames > 0) && (total_frame >= sv->read_budget_frames))
+		{
+			// 今回のframe数に達した
+			return;
+		}
+	}
+}
+
+/**
+ * acceptしたsocketのコネクション登録
+ *
+ * @param tcp_t *sv [in]
+ * @param int soc [in] : acceptしたsocket
+ * @return int : 成功:1 / コネクションが確保できない:0
+ */
+static int __accept_connection(tcp_t *sv, int soc)
+{
+	connection_t *conn = (connection_t *)pool_alloc(sv->connection_a);
 	if (conn == NULL)
 	{
 		_PRINTF("%s : no more connection!!\n", __func__);
 		close(soc);
-		return;
+		return 0;
 	}
+	conn->generation = ++sv->generation_seq;
 	_PRINTF("connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
 	conn->soc = soc;
 
-	fcntl(conn->soc, F_SETFL, O_NONBLOCK | O_RDWR); // non blocking
-	int val = SOCKET_RECV_BUFFER_SIZE;
-	setsockopt(conn->soc, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)); // recv buffer size
-	val = SOCKET_SEND_BUFFER_SIZE;
-	setsockopt(conn->soc, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)); // send buffer size
-
+	// non blocking, close on execはaccept4で設定済み。受信/送信バッファサイズはlisten socketから引き継ぐ
 	event_set(&(conn->event), conn->soc, EV_READ | EV_PERSIST, __read_event_callback, conn);
 	event_base_set(sv->event_base, &(conn->event));
 	event_add(&(conn->event), NULL);
+	event_set(&(conn->wevent), conn->soc, EV_WRITE | EV_PERSIST, __write_event_callback, conn);
+	event_base_set(sv->event_base, &(conn->wevent));
+	conn->wevent_added = 0;
+	conn->wtop = NULL;
+	conn->wlast = NULL;
+	conn->wlen = 0;
 	conn->recv_func = sv->server.listen_conn.recv_func;
 	conn->close_func = sv->server.listen_conn.close_func;
 	conn->parse_func = sv->server.listen_conn.parse_func;
+	conn->frame_func = sv->server.listen_conn.frame_func;
 	conn->rcheck_func = NULL;
 	conn->parent = (void *)sv;
-	conn->rbuffer.len = 0;
-	conn->rbuffer.next = NULL;
+	conn->rbuffer = NULL;
 	conn->pair = NULL;
+	conn->wm_low = sv->server.listen_conn.wm_low;
+	conn->wm_high = sv->server.listen_conn.wm_high;
+	conn->wm_limit = sv->server.listen_conn.wm_limit;
+	conn->wm_func = sv->server.listen_conn.wm_func;
+	conn->wm_over = 0;
+	conn->wm_shut = 0;
+	conn->rpipe[0] = -1;
+	conn->rpipe[1] = -1;
+	conn->rpipe_len = 0;
+	conn->pair_linked = 0;
+	conn->read_paused = 0;
+	conn->connecting = 0;
+	conn->connect_func = NULL;
+	conn->pool_slot = NULL;
+
+	if (sv->server.accept_func != NULL)
+	{
+		// accept callbaskが指定されていたらcallbackを呼び出す
+		if (sv->server.accept_func(conn) < 0)
+		{
+			// 負の値を返してきたらコネクションを受け付けない
+			CONN_CLEAR(conn);
+			_PRINTF("accept_func failed : connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
+		}
+	}
+	return 1;
+}
+
+/**
+ * acceptイベント処理
+ *
+ * EAGAINになるか、1回のイベントでacceptする数に達するまでacceptする
+ *
+ * @param int soc [in] : イベント発生ソケット
+ * @param short events [in] : 発生イベント種類
+ * @param void *user_data [in] : ユーザ設定データ：tcp_t構造体へのポインタ
+ */
+static void __accept_event_callback(int event_soc, short events, void *user_data)
+{
+	socklen_t addr_len;
+	struct sockaddr_in caddr;
+	int soc = 1;
+	tcp_t *sv = (tcp_t *)user_data;
+
+	_PRINTF("accept event callback\n");
+
+	if (!(events & EV_READ))
+	{
+		// READ eventではない
+		_PRINTF("%s : event = 0x%X\n", __func__, events);
+		return;
+	}
+
+	int n;
+	for (n = 0; (sv->server.accept_budget <= 0) || (n < sv->server.accept_budget); n++)
+	{
+		if (sv->server.acheck_func != NULL)
+		{
+			// accept可否チェック関数が指定されている
+			if (sv->server.acheck_func(sv) < 0)
+			{
+				// acceptできる状態ではない
+				return;
+			}
+		}
+
+		addr_len = sizeof(struct sockaddr_in);
+		if ((soc = accept4(event_soc, (struct sockaddr *)&caddr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		{
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+			{
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			{
+				_PRINTF("%s : accept failed : %s(%d) \n", __func__, strerror(errno), errno);
+			}
+			return;
+		}
 
-	if (sv->server.accept_func != NULL)
-	{
-		// accept callbaskが指定されていたらcallbackを呼び出す
-		if (sv->server.accept_func(conn) < 0)
+		if (!__accept_connection(sv, soc))
 		{
-			// 負の値を返してきたらコネクションを受け付けない
-			CONN_CLEAR(conn);
-			_PRINTF("accept_func failed : connlist : %d / %d\n", get_element_use_num(sv->connection_a), get_element_max_num(sv->connection_a));
+			return;
 		}
 	}
 }
@@ -655,6 +1481,81 @@ int netio_poll(void)
 /**
  * netio polling
  */
+/**
+ * 負荷が下がったpoolの未使用blockの解放
+ *
+ * 使用数が容量の1/POOL_TRIM_RATIO未満の状態がPOOL_TRIM_INTERVAL続いたらpool_trimする。
+ * 使用数と同じだけの空きは残す（すぐに先行拡張されないように）
+ *
+ * @param void *pool
+ * @param time_t *low_time [in/out] : 使用数が下回った時刻(0:下回っていない)
+ * @param time_t now : 現在時刻(sec)
+ */
+static inline void __trim_idle_pool(void *pool, time_t *low_time, time_t now)
+{
+	int use = get_element_use_num(pool);
+	if (use * POOL_TRIM_RATIO >= get_element_max_num(pool))
+	{
+		*low_time = 0;
+		return;
+	}
+	if (*low_time == 0)
+	{
+		*low_time = now;
+		return;
+	}
+	if (now - *low_time < POOL_TRIM_INTERVAL)
+	{
+		return;
+	}
+	pool_trim(pool, use);
+	*low_time = now; // まだ下回っていれば、次もPOOL_TRIM_INTERVAL後
+}
+
+/**
+ * pollの合間の保守処理
+ *
+ * poolの空きが少なくなっていたら先に拡張しておき、
+ * 接続が集中した時にaccept/受信の中で拡張(page fault)が起きないようにする。
+ * また、負荷が下がったbufferのpoolから使われなくなったblockを解放する
+ * （connection_aは解放しない。nio_connのhandleがunmapされた領域を指すことになるため）
+ *
+ * @param tcp_t *tcp
+ */
+static inline void __tcp_maintenance(tcp_t *tcp)
+{
+	if (tcp->connection_a != NULL)
+	{
+		pool_grow_ahead(tcp->connection_a, get_element_max_num(tcp->connection_a) / POOL_GROW_AHEAD_RATIO);
+	}
+	int i;
+	for (i = 0; i < RBUFFER_CLASS_NUM; i++)
+	{
+		if (tcp->rbuffer_a[i] != NULL)
+		{
+			pool_grow_ahead(tcp->rbuffer_a[i], get_element_max_num(tcp->rbuffer_a[i]) / POOL_GROW_AHEAD_RATIO);
+		}
+	}
+
+	// 接続が集中した後に増えたままのメモリを、負荷が下がってから返す
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < RBUFFER_CLASS_NUM; i++)
+	{
+		if (tcp->rbuffer_a[i] != NULL)
+		{
+			__trim_idle_pool(tcp->rbuffer_a[i], &(tcp->rbuffer_low_time[i]), now.tv_sec);
+		}
+	}
+	for (i = 0; i < WBUFFER_POOL_NUM; i++)
+	{
+		if (tcp->wbuffer_a[i] != NULL)
+		{
+			__trim_idle_pool(tcp->wbuffer_a[i], &(tcp->wbuffer_low_time[i]), now.tv_sec);
+		}
+	}
+}
+
 static inline void __nio_tcp_poll(tcp_t *tcp, int timeout)
 {
 	struct timeval tv;
@@ -663,6 +1564,8 @@ static inline void __nio_tcp_poll(tcp_t *tcp, int timeout)
 
 	event_base_loopexit(tcp->event_base, &tv);
 	event_base_loop(tcp->event_base, 0);
+
+	__tcp_maintenance(tcp);
 }
 
 /********************************************************/
@@ -677,6 +1580,12 @@ void netio_tcp_poll(nio_tcp ntcp, int timeout)
 	tcp_t *tcp = NULL;
 	NETIO_TO_TCP(tcp, ntcp, );
 
+	if (tcp->event_base == NULL)
+	{
+		// multi reactorの親サーバ（各reactorはそれぞれのthreadで動いている）
+		usleep(timeout);
+		return;
+	}
 	__nio_tcp_poll(tcp, timeout);
 	return;
 }
@@ -699,6 +1608,144 @@ void netio_client_poll(nio_client ncl, int timeout)
 	return;
 }
 
+/*******************************************************/
+/**
+ * async send要求nodeの解放
+ *
+ * @param tcp_t *tcp
+ * @param async_node_t *node
+ */
+static inline void __free_async_node(tcp_t *tcp, async_node_t *node)
+{
+	if (node->pooled)
+	{
+		mtpool_free(tcp->async_a, node);
+	}
+	else
+	{
+		free(node);
+	}
+}
+
+/**
+ * async send要求の処理
+ *
+ * 他threadから積まれた要求をまとめて取り出し、要求順にnetio_senderで送信する
+ *
+ * @param tcp_t *tcp
+ */
+static void __drain_async(tcp_t *tcp)
+{
+	// listごと取り出す（producerはpushしかしないのでexchangeだけでよい）
+	async_node_t *node = __atomic_exchange_n(&(tcp->async_head), NULL, __ATOMIC_ACQUIRE);
+
+	// 新しい順に並んでいるので反転する
+	async_node_t *list = NULL;
+	while (node != NULL)
+	{
+		async_node_t *next = node->next;
+		node->next = list;
+		list = node;
+		node = next;
+	}
+
+	while (list != NULL)
+	{
+		async_node_t *next = list->next;
+		nio_conn c = netio_conn_from_id(tcp, list->id);
+		if (c != NIO_INVALID_HANDLE)
+		{
+			netio_sender(c, list->data, list->len);
+		}
+		else
+		{
+			// 要求後に切断された（同じ位置が再利用されていてもgenerationが違う）
+			_PRINTF("%s : connection closed : %llx\n", __func__, (unsigned long long)list->id);
+		}
+		__free_async_node(tcp, list);
+		list = next;
+	}
+}
+
+/**
+ * async send wakeup event callback
+ *
+ * @param int fd
+ * @param short events
+ * @param void *user_data
+ */
+static void __async_event_callback(int fd, short events, void *user_data)
+{
+	tcp_t *tcp = (tcp_t *)user_data;
+	uint64_t val;
+
+	// wakeupのカウンタをクリアしてから取り出す
+	// （クリア後に積まれた要求は再度wakeupされる）
+	if (read(fd, &val, sizeof(val)) < 0)
+	{
+		_PRINTF("%s : read failed : %d\n", __func__, errno);
+	}
+	__drain_async(tcp);
+}
+
+/**
+ * async send 初期化
+ *
+ * @param tcp_t *tcp : event_base設定済みのtcp
+ * @return int : 成功:1 / 失敗:0
+ */
+static int __init_async(tcp_t *tcp)
+{
+	tcp->async_head = NULL;
+	// 要求nodeは他threadで確保してreactorで解放するのでthread safeなpoolを使う
+	tcp->async_a = init_mtpool(sizeof(async_node_t) + ASYNC_NODE_DATA_SIZE, ASYNC_NODE_NUM, 0, 0, 0);
+	if (tcp->async_a == NULL)
+	{
+		_PRINTF("%s : init_mtpool (async_a) failed\n", __func__);
+		return 0;
+	}
+	tcp->async_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (tcp->async_fd < 0)
+	{
+		_PRINTF("%s : eventfd failed : %d\n", __func__, errno);
+		release_mtpool(tcp->async_a);
+		tcp->async_a = NULL;
+		return 0;
+	}
+	memset(&(tcp->async_event), 0, sizeof(struct event));
+	event_set(&(tcp->async_event), tcp->async_fd, EV_READ | EV_PERSIST, __async_event_callback, tcp);
+	event_base_set(tcp->event_base, &(tcp->async_event));
+	event_add(&(tcp->async_event), NULL);
+	return 1;
+}
+
+/**
+ * async send 解放
+ *
+ * @param tcp_t *tcp
+ */
+static void __release_async(tcp_t *tcp)
+{
+	if (tcp->async_fd < 0)
+	{
+		return;
+	}
+	event_del(&(tcp->async_event));
+	close(tcp->async_fd);
+	tcp->async_fd = -1;
+
+	// 未処理の要求は捨てる
+	async_node_t *node = __atomic_exchange_n(&(tcp->async_head), NULL, __ATOMIC_ACQUIRE);
+	while (node != NULL)
+	{
+		async_node_t *next = node->next;
+		__free_async_node(tcp, node);
+		node = next;
+	}
+	release_mtpool(tcp->async_a);
+	tcp->async_a = NULL;
+}
+
 /*******************************************************/
 /**
  * nio_tcp 初期化(server/client共通部分)
@@ -713,25 +1760,43 @@ static inline tcp_t *netio_init_tcp(unsigned int tcpbuffsize, unsigned int conbu
 		_PRINTF("%s : no more alloc\n", __func__);
 		return NIO_INVALID_HANDLE;
 	}
-	// connection list準備
-	tcp->connection_a = init_pool_with_max(sizeof(connection_t) + conbuffsize, _DEFAULT_CONNECTION_NUM, _MAX_CONNECTION_NUM);
+	tcp->read_budget_bytes = READ_BUDGET_BYTES;
+	tcp->read_budget_frames = READ_BUDGET_FRAMES;
+	tcp->max_frame_size = MAX_FRAME_SIZE;
+	tcp->async_fd = -1;
+
+	// connection list準備（NIO_CONN_SCAN等で走査するので、使用中要素をbitmapで探せるようにする）
+	tcp->connection_a = init_pool_with_option(sizeof(connection_t) + conbuffsize, _DEFAULT_CONNECTION_NUM, _MAX_CONNECTION_NUM, NIO_POOL_OPTION | POOL_OPT_BITMAP);
 	if (tcp->connection_a == NULL)
 	{
-		_PRINTF("%s : init_pool_with_max (connection_a) failed : %u %u %d\n", __func__, (int)sizeof(connection_t), conbuffsize, _DEFAULT_CONNECTION_NUM);
+		_PRINTF("%s : init_pool_with_option (connection_a) failed : %u %u %d\n", __func__, (int)sizeof(connection_t), conbuffsize, _DEFAULT_CONNECTION_NUM);
 		return NIO_INVALID_HANDLE;
 	}
-	// message buffer list
-	tcp->wbuffer_m = message_create(MESSAGE_HASH_SIZE, sizeof(write_buffer_t), MAX(_DEFAULT_CONNECTION_NUM / 8, 16));
-	if (tcp->wbuffer_m == NULL)
+	// write buffer (size class毎 + 参照)
+	int i;
+	for (i = 0; i < WBUFFER_POOL_NUM; i++)
 	{
-		_PRINTF("%s : message_create failed\n", __func__);
-		return NIO_INVALID_HANDLE;
+		tcp->wbuffer_a[i] = init_pool_with_option(sizeof(write_buffer_t) + wbuffer_class_size[i], wbuffer_class_num[i], 0, NIO_POOL_OPTION);
+		if (tcp->wbuffer_a[i] == NULL)
+		{
+			_PRINTF("%s : init_pool_with_option (wbuffer_a[%d]) failed\n", __func__, i);
+			return NIO_INVALID_HANDLE;
+		}
 	}
 	// recv buffer
-	tcp->rbuffer_a = init_pool_with_max(sizeof(recv_buffer_t), 4, _MAX_CONNECTION_NUM);
-	if (tcp->rbuffer_a == NULL)
+	for (i = 0; i < RBUFFER_CLASS_NUM; i++)
+	{
+		tcp->rbuffer_a[i] = init_pool_with_option(sizeof(recv_buffer_t) + rbuffer_class_size[i], rbuffer_class_num[i], _MAX_CONNECTION_NUM, NIO_POOL_OPTION);
+		if (tcp->rbuffer_a[i] == NULL)
+		{
+			_PRINTF("%s : init_pool_with_option (rbuffer_a[%d]) failed\n", __func__, i);
+			return NIO_INVALID_HANDLE;
+		}
+	}
+	// parse結果格納領域
+	if (!__reserve_parsed_buffer(tcp, BUFFER_SIZE + 1))
 	{
-		_PRINTF("%s : init_pool_with_max (rbuffer_a) failed : %u\n", __func__, (int)sizeof(recv_buffer_t));
+		_PRINTF("%s : parsed_buffer alloc failed\n", __func__);
 		return NIO_INVALID_HANDLE;
 	}
 	return tcp;
@@ -739,15 +1804,16 @@ static inline tcp_t *netio_init_tcp(unsigned int tcpbuffsize, unsigned int conbu
 
 /*******************************************************/
 /**
- * nio_server 初期化
+ * nio_server 初期化(共通部分)
  *
  * @param unsigned short listen_port [in] : listen port番号
  * @param unsigned int tcpbuffsize [in] : netio_tcp_get_buffer で取得できるバッファサイズ
  * @param unsigned int conbuffsize [in] : netio_connection_get_buffer で取得できるコネクションバッファサイズ
- * @param void *group  [in] : 同一グループ 既に確保されたnio_server, nio_client, netio_init_groupで初期化されたグループを渡す
- * @return nio_server
+ * @param void *group  [in] : 同一グループ
+ * @param int reuseport [in] : SO_REUSEPORTを設定するか
+ * @return tcp_t *
  */
-nio_server netio_init_server(unsigned short listen_port, unsigned int tcpbuffsize, unsigned int conbuffsize, void *group)
+static tcp_t *__init_server(unsigned short listen_port, unsigned int tcpbuffsize, unsigned int conbuffsize, void *group, int reuseport)
 {
 	tcp_t *sv = netio_init_tcp(tcpbuffsize, conbuffsize);
 	if (sv == NIO_INVALID_HANDLE)
@@ -770,13 +1836,18 @@ nio_server netio_init_server(unsigned short listen_port, unsigned int tcpbuffsiz
 	int val = 1;
 	//	  setsockopt(c->soc, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));	  // no delay
 	setsockopt(c->soc, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)); // reuse address
-																	 //	  setsockopt(c->soc, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));	  // keepalive
-																	 //	  fcntl(c->soc, F_SETFL, O_NONBLOCK | O_RDWR);						  // non block
-	fcntl(c->soc, F_SETFD, FD_CLOEXEC);								 // close on exec
-																	 //	  val = SOCKET_RECV_BUFFER_SIZE;
-																	 //	  setsockopt(c->soc, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)); 	  // recv buffer size
-																	 //	  val = SOCKET_SEND_BUFFER_SIZE;
-																	 //	  setsockopt(c->soc, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)); 	  // send buffer size
+	if (reuseport)
+	{
+		setsockopt(c->soc, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)); // 同一portを複数socketでlisten
+	}
+	//	  setsockopt(c->soc, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));	  // keepalive
+	fcntl(c->soc, F_SETFL, O_NONBLOCK | O_RDWR); // non block (EAGAINまでacceptするため)
+	fcntl(c->soc, F_SETFD, FD_CLOEXEC);			 // close on exec
+	// acceptしたsocketに引き継がれる
+	val = SOCKET_RECV_BUFFER_SIZE;
+	setsockopt(c->soc, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)); // recv buffer size
+	val = SOCKET_SEND_BUFFER_SIZE;
+	setsockopt(c->soc, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)); // send buffer size
 
 	// portへのbind
 	if (bind(c->soc, (struct sockaddr *)&(sv->addr), sizeof(sv->addr)) == -1)
@@ -786,38 +1857,251 @@ nio_server netio_init_server(unsigned short listen_port, unsigned int tcpbuffsiz
 		return NIO_INVALID_HANDLE;
 	}
 
-	// listen開始
-	if (listen(c->soc, SOMAXCONN) == -1)
+	// listen開始
+	if (listen(c->soc, SOMAXCONN) == -1)
+	{
+		_PRINTF("%s : listen failed\n", __func__);
+		netio_release_server(sv);
+		return NIO_INVALID_HANDLE;
+	}
+
+	// acceptイベントの設定
+	sv->event_base = group ? ((tcp_t *)group)->event_base : event_base_new();
+	memset(&(c->event), 0, sizeof(struct event));
+	event_set(&(c->event), c->soc, EV_READ | EV_PERSIST, __accept_event_callback, sv);
+	event_base_set(sv->event_base, &(c->event));
+	event_add(&(c->event), NULL);
+
+	// 他threadからの送信要求
+	if (!__init_async(sv))
+	{
+		netio_release_server(sv);
+		return NIO_INVALID_HANDLE;
+	}
+
+	sv->server.accept_func = NULL;
+	sv->server.acheck_func = NULL;
+	sv->server.accept_budget = ACCEPT_BUDGET;
+	c->close_func = NULL;
+	c->recv_func = NULL;
+	c->parse_func = NULL;
+	c->frame_func = NULL;
+	c->rbuffer = NULL;
+
+	return sv;
+}
+
+/*******************************************************/
+/**
+ * nio_server 初期化
+ *
+ * @param unsigned short listen_port [in] : listen port番号
+ * @param unsigned int tcpbuffsize [in] : netio_tcp_get_buffer で取得できるバッファサイズ
+ * @param unsigned int conbuffsize [in] : netio_connection_get_buffer で取得できるコネクションバッファサイズ
+ * @param void *group  [in] : 同一グループ 既に確保されたnio_server, nio_client, netio_init_groupで初期化されたグループを渡す
+ * @return nio_server
+ */
+nio_server netio_init_server(unsigned short listen_port, unsigned int tcpbuffsize, unsigned int conbuffsize, void *group)
+{
+	return (nio_server)__init_server(listen_port, tcpbuffsize, conbuffsize, group, 0);
+}
+
+/*******************************************************/
+/**
+ * nio_server 初期化(multi reactor)
+ *
+ * SO_REUSEPORTで同じportをlistenするreactorをnthreads個作成します。
+ * reactorはそれぞれevent_base、コネクションpool、書き込みバッファを持ち、
+ * netio_server_startでcoreに固定したthreadで動き始めます。
+ * callbackはコネクションを受け付けたreactorのthreadから呼ばれます。
+ * callback等の設定は、返された親サーバに対してnetio_server_startの前に行ってください。
+ *
+ * @param unsigned short listen_port [in] : listen port番号
+ * @param int nthreads [in] : reactor(thread)数(MAX_REACTOR_NUMまで)
+ * @param unsigned int tcpbuffsize [in] : netio_tcp_get_buffer で取得できるバッファサイズ
+ * @param unsigned int conbuffsize [in] : netio_connection_get_buffer で取得できるコネクションバッファサイズ
+ * @return nio_server : 親サーバ
+ */
+nio_server netio_init_server_mt(unsigned short listen_port, int nthreads, unsigned int tcpbuffsize, unsigned int conbuffsize)
+{
+	if ((nthreads <= 0) || (nthreads > MAX_REACTOR_NUM))
+	{
+		return NIO_INVALID_HANDLE;
+	}
+
+	// 親サーバ（設定の保持のみ、event_baseは持たない）
+	tcp_t *master = netio_init_tcp(tcpbuffsize, 0);
+	if (master == NIO_INVALID_HANDLE)
+	{
+		return NIO_INVALID_HANDLE;
+	}
+	master->addr.sin_port = htons(listen_port);
+	master->addr.sin_family = AF_INET;
+	master->addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	master->server.listen_conn.soc = -1;
+
+	master->server.reactor = (tcp_t **)calloc(nthreads, sizeof(tcp_t *));
+	master->server.thread = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	if ((master->server.reactor == NULL) || (master->server.thread == NULL))
+	{
+		_PRINTF("%s : no more alloc\n", __func__);
+		netio_release_server(master);
+		return NIO_INVALID_HANDLE;
+	}
+
+	int i;
+	for (i = 0; i < nthreads; i++)
+	{
+		tcp_t *sv = __init_server(listen_port, tcpbuffsize, conbuffsize, NULL, 1);
+		if (sv == NIO_INVALID_HANDLE)
+		{
+			_PRINTF("%s : reactor init failed : %d\n", __func__, i);
+			netio_release_server(master);
+			return NIO_INVALID_HANDLE;
+		}
+		sv->server.master = master;
+		sv->reactor_index = i;
+		master->server.reactor[i] = sv;
+		master->server.n_reactor++;
+	}
+
+	return (nio_server)master;
+}
+
+/**
+ * reactor thread
+ *
+ * @param void *arg : reactorのtcp_t
+ * @return void *
+ */
+static void *__reactor_thread(void *arg)
+{
+	tcp_t *sv = (tcp_t *)arg;
+	tcp_t *master = sv->server.master;
+
+	while (__atomic_load_n(&(master->server.running), __ATOMIC_ACQUIRE))
+	{
+		__nio_tcp_poll(sv, REACTOR_POLL_TIMEOUT);
+	}
+	return NULL;
+}
+
+/**
+ * multi reactor サーバの開始
+ *
+ * 親サーバに設定されたcallback等を各reactorにコピーしてthreadを起動します
+ *
+ * @param nio_server nsv [in] : netio_init_server_mtで作成したサーバ
+ * @return int : 成功:1 / 失敗:0
+ */
+int netio_server_start(nio_server nsv)
+{
+	tcp_t *master = NULL;
+	NETIO_TO_TCP(master, nsv, 0);
+
+	if ((master->server.n_reactor == 0) || __atomic_load_n(&(master->server.running), __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+
+	// 使用できるcore（cgroup/tasksetで制限されている場合はその中から割り当てる）
+	cpu_set_t allowed;
+	int ncpu = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) ? CPU_COUNT(&allowed) : 0;
+	__atomic_store_n(&(master->server.running), 1, __ATOMIC_RELEASE);
+
+	int i;
+	for (i = 0; i < master->server.n_reactor; i++)
+	{
+		tcp_t *sv = master->server.reactor[i];
+		connection_t *c = &(sv->server.listen_conn);
+		connection_t *mc = &(master->server.listen_conn);
+
+		// 設定のコピー
+		sv->server.accept_func = master->server.accept_func;
+		sv->server.acheck_func = master->server.acheck_func;
+		sv->server.accept_budget = master->server.accept_budget;
+		c->close_func = mc->close_func;
+		c->recv_func = mc->recv_func;
+		c->parse_func = mc->parse_func;
+		c->frame_func = mc->frame_func;
+		c->wm_low = mc->wm_low;
+		c->wm_high = mc->wm_high;
+		c->wm_limit = mc->wm_limit;
+		c->wm_func = mc->wm_func;
+		sv->read_budget_bytes = master->read_budget_bytes;
+		sv->read_budget_frames = master->read_budget_frames;
+		sv->max_frame_size = master->max_frame_size;
+
+		// coreへの固定（起動前にattrで指定して、別のcoreで走り始めないようにする）
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (ncpu > 0)
+		{
+			// 使用できるcoreのうち(i % ncpu)番目
+			int cpu = -1;
+			int n = i % ncpu;
+			while (n >= 0)
+			{
+				if (CPU_ISSET(++cpu, &allowed))
+				{
+					n--;
+				}
+			}
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpu, &cpuset);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+		}
+		int ret = pthread_create(&(master->server.thread[i]), &attr, __reactor_thread, sv);
+		pthread_attr_destroy(&attr);
+		if (ret != 0)
+		{
+			_PRINTF("%s : pthread_create failed : %d %d\n", __func__, i, ret);
+			__atomic_store_n(&(master->server.running), 0, __ATOMIC_RELEASE);
+			for (i--; i >= 0; i--)
+			{
+				pthread_join(master->server.thread[i], NULL);
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * multi reactor : reactor数の取得
+ *
+ * @param nio_server nsv [in]
+ * @return int
+ */
+int netio_server_get_reactor_num(nio_server nsv)
+{
+	tcp_t *master = NULL;
+	NETIO_TO_TCP(master, nsv, 0);
+
+	return master->server.n_reactor;
+}
+
+/**
+ * multi reactor : reactorの取得
+ *
+ * 取得したreactorの操作はそのreactorのthread(callback内)から行ってください
+ *
+ * @param nio_server nsv [in]
+ * @param int index [in]
+ * @return nio_server
+ */
+nio_server netio_server_get_reactor(nio_server nsv, int index)
+{
+	tcp_t *master = NULL;
+	NETIO_TO_TCP(master, nsv, NIO_INVALID_HANDLE);
+
+	if ((index < 0) || (index >= master->server.n_reactor))
 	{
-		_PRINTF("%s : listen failed\n", __func__);
-		netio_release_server(sv);
 		return NIO_INVALID_HANDLE;
 	}
-
-	// acceptイベントの設定
-	sv->event_base = group ? ((tcp_t *)group)->event_base : event_base_new();
-	memset(&(c->event), 0, sizeof(struct event));
-	event_set(&(c->event), c->soc, EV_READ | EV_PERSIST, __accept_event_callback, sv);
-	event_base_set(sv->event_base, &(c->event));
-	event_add(&(c->event), NULL);
-
-	// timer イベントの設定
-	memset(&(sv->event), 0, sizeof(struct event));
-	evtimer_set(&(sv->event), __timer_event_callback, sv);
-	event_base_set(sv->event_base, &(sv->event));
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 10000;
-	evtimer_add(&(sv->event), &tv);
-
-	sv->server.accept_func = NULL;
-	sv->server.acheck_func = NULL;
-	c->close_func = NULL;
-	c->recv_func = NULL;
-	c->parse_func = NULL;
-	c->rbuffer.len = 0;
-
-	return (nio_server)sv;
+	return (nio_server)master->server.reactor[index];
 }
 
 /**
@@ -829,6 +2113,29 @@ void netio_release_server(nio_server s)
 {
 	tcp_t *sv = (tcp_t *)s;
 
+	if (sv->server.reactor != NULL)
+	{
+		// multi reactor : threadを止めてから各reactorを解放
+		int i;
+		if (__atomic_load_n(&(sv->server.running), __ATOMIC_ACQUIRE))
+		{
+			__atomic_store_n(&(sv->server.running), 0, __ATOMIC_RELEASE);
+			for (i = 0; i < sv->server.n_reactor; i++)
+			{
+				pthread_join(sv->server.thread[i], NULL);
+			}
+		}
+		for (i = 0; i < sv->server.n_reactor; i++)
+		{
+			struct event_base *base = sv->server.reactor[i]->event_base;
+			netio_release_server(sv->server.reactor[i]);
+			event_base_free(base);
+		}
+		FREE(sv->server.reactor);
+		FREE(sv->server.thread);
+		sv->server.n_reactor = 0;
+	}
+
 	if (sv->connection_a != NULL)
 	{
 		// 有効なコネクションをclose
@@ -845,25 +2152,39 @@ void netio_release_server(nio_server s)
 		release_pool(sv->connection_a);
 	}
 
-	// listen port close
-	event_del(&(sv->server.listen_conn.event));
-	close(sv->server.listen_conn.soc);
+	__release_async(sv);
 
-	// イベントの終了
-	event_del(&(sv->event));
+	// listen port close
+	if (sv->event_base != NULL)
+	{
+		event_del(&(sv->server.listen_conn.event));
+	}
+	if (sv->server.listen_conn.soc >= 0)
+	{
+		close(sv->server.listen_conn.soc);
+	}
 
 	// メモリの開放
-	if (sv->wbuffer_m != NULL)
+	int i;
+	for (i = 0; i < WBUFFER_POOL_NUM; i++)
 	{
-		message_release(sv->wbuffer_m);
-		sv->wbuffer_m = NULL;
+		if (sv->wbuffer_a[i] != NULL)
+		{
+			release_pool(sv->wbuffer_a[i]);
+			sv->wbuffer_a[i] = NULL;
+		}
 	}
 	// recv bufferの解放
-	if (sv->rbuffer_a != NULL)
+	for (i = 0; i < RBUFFER_CLASS_NUM; i++)
 	{
-		release_pool(sv->rbuffer_a);
-		sv->rbuffer_a = NULL;
+		if (sv->rbuffer_a[i] != NULL)
+		{
+			release_pool(sv->rbuffer_a[i]);
+			sv->rbuffer_a[i] = NULL;
+		}
 	}
+	// parse結果格納領域の解放
+	FREE(sv->parsed_buffer);
 
 	free(sv);
 }
@@ -899,14 +2220,12 @@ nio_client netio_init_client(const char *address, unsigned short port, unsigned
 
 	cli->event_base = group ? ((tcp_t *)group)->event_base : event_base_new();
 
-	// timer イベントの設定
-	memset(&(cli->event), 0, sizeof(struct event));
-	evtimer_set(&(cli->event), __timer_event_callback, cli);
-	event_base_set(cli->event_base, &(cli->event));
-	struct timeval tv;
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	evtimer_add(&(cli->event), &tv);
+	// 他threadからの送信要求
+	if (!__init_async(cli))
+	{
+		netio_release_client(cli);
+		return NIO_INVALID_HANDLE;
+	}
 
 	strncpy(cli->client.address, address, sizeof(cli->client.address) - 1);
 	cli->client.address[sizeof(cli->client.address) - 1] = '\0';
@@ -915,6 +2234,11 @@ nio_client netio_init_client(const char *address, unsigned short port, unsigned
 	cli->client.close_func = NULL;
 	cli->client.recv_func = NULL;
 	cli->client.parse_func = NULL;
+	cli->client.frame_func = NULL;
+	cli->client.connect_func = NULL;
+	cli->client.connect_timeout = 0;
+	cli->client.pool = NULL;
+	cli->client.pool_num = 0;
 
 	return (nio_client)cli;
 }
@@ -928,6 +2252,8 @@ void netio_release_client(nio_client tcp)
 {
 	tcp_t *cli = (tcp_t *)tcp;
 
+	__release_client_pool(cli);
+
 	if (cli->connection_a != NULL)
 	{
 		// 有効なコネクションをclose
@@ -945,26 +2271,92 @@ void netio_release_client(nio_client tcp)
 		cli->connection_a = NULL;
 	}
 
-	// イベントの終了
-	event_del(&(cli->event));
+	__release_async(cli);
 
 	// 書き込みバッファメモリの開放
-	if (cli->wbuffer_m != NULL)
+	int i;
+	for (i = 0; i < WBUFFER_POOL_NUM; i++)
 	{
-		message_release(cli->wbuffer_m);
-		cli->wbuffer_m = NULL;
+		if (cli->wbuffer_a[i] != NULL)
+		{
+			release_pool(cli->wbuffer_a[i]);
+			cli->wbuffer_a[i] = NULL;
+		}
 	}
 	// recv bufferの解放
-	if (cli->rbuffer_a != NULL)
+	for (i = 0; i < RBUFFER_CLASS_NUM; i++)
 	{
-		release_pool(cli->rbuffer_a);
-		cli->rbuffer_a = NULL;
+		if (cli->rbuffer_a[i] != NULL)
+		{
+			release_pool(cli->rbuffer_a[i]);
+			cli->rbuffer_a[i] = NULL;
+		}
 	}
+	// parse結果格納領域の解放
+	FREE(cli->parsed_buffer);
 
 	memset(cli, 0, sizeof(tcp_t));
 	free(cli);
 }
 
+/**
+ * client 接続中コネクションの初期化(共通部分)
+ *
+ * 接続が完了するまではwrite eventだけを登録し、完了(またはタイムアウト)を__write_event_callbackで検知する
+ *
+ * @param tcp_t *cli [in]
+ * @param connection_t *conn [in] : connect済み(EINPROGRESS含む)のコネクション
+ */
+static void __init_client_conn(tcp_t *cli, connection_t *conn)
+{
+	memset(&(conn->event), 0, sizeof(struct event));
+	event_set(&(conn->event), conn->soc, EV_READ | EV_PERSIST, __read_event_callback, conn);
+	event_base_set(cli->event_base, &(conn->event));
+	memset(&(conn->wevent), 0, sizeof(struct event));
+	event_set(&(conn->wevent), conn->soc, EV_WRITE | EV_PERSIST, __write_event_callback, conn);
+	event_base_set(cli->event_base, &(conn->wevent));
+	conn->wtop = NULL;
+	conn->wlast = NULL;
+	conn->wlen = 0;
+
+	conn->close_func = cli->client.close_func;
+	conn->recv_func = cli->client.recv_func;
+	conn->parse_func = cli->client.parse_func;
+	conn->frame_func = cli->client.frame_func;
+	conn->rcheck_func = NULL;
+	conn->rbuffer = NULL;
+	conn->parent = cli;
+	conn->pair = NULL;
+	conn->wm_low = cli->client.wm_low;
+	conn->wm_high = cli->client.wm_high;
+	conn->wm_limit = cli->client.wm_limit;
+	conn->wm_func = cli->client.wm_func;
+	conn->wm_over = 0;
+	conn->wm_shut = 0;
+	conn->rpipe[0] = -1;
+	conn->rpipe[1] = -1;
+	conn->rpipe_len = 0;
+	conn->pair_linked = 0;
+	conn->read_paused = 0;
+	conn->connect_func = cli->client.connect_func;
+	conn->pool_slot = NULL;
+
+	// 接続完了待ち
+	conn->connecting = 1;
+	if (cli->client.connect_timeout > 0)
+	{
+		struct timeval tv;
+		tv.tv_sec = cli->client.connect_timeout / 1000;
+		tv.tv_usec = (cli->client.connect_timeout % 1000) * 1000;
+		event_add(&(conn->wevent), &tv);
+	}
+	else
+	{
+		event_add(&(conn->wevent), NULL);
+	}
+	conn->wevent_added = 1;
+}
+
 /**
  * client 接続
  *
@@ -983,6 +2375,7 @@ nio_conn netio_client_connect(nio_client nclient)
 		_PRINTF("%s : no more connection!!\n", __func__);
 		return NIO_INVALID_HANDLE;
 	}
+	conn->generation = ++cli->generation_seq;
 
 	// socket作成
 	if ((conn->soc = socket(AF_INET, SOCK_STREAM, 0)) == -1)
@@ -1011,17 +2404,7 @@ nio_conn netio_client_connect(nio_client nclient)
 		}
 	}
 
-	memset(&(conn->event), 0, sizeof(struct event));
-	event_set(&(conn->event), conn->soc, EV_READ | EV_PERSIST, __read_event_callback, conn);
-	event_base_set(cli->event_base, &(conn->event));
-	event_add(&(conn->event), NULL);
-
-	conn->close_func = cli->client.close_func;
-	conn->recv_func = cli->client.recv_func;
-	conn->parse_func = cli->client.parse_func;
-	conn->rbuffer.len = 0;
-	conn->rbuffer.next = NULL;
-	conn->parent = cli;
+	__init_client_conn(cli, conn);
 
 	return (nio_conn)conn;
 }
@@ -1060,6 +2443,7 @@ nio_conn netio_client_connect_by_address(nio_client nclient, const char *address
 		_PRINTF("%s : no more connection!!\n", __func__);
 		return NIO_INVALID_HANDLE;
 	}
+	conn->generation = ++cli->generation_seq;
 
 	// socket作成
 	if ((conn->soc = socket(AF_INET, SOCK_STREAM, 0)) == -1)
@@ -1087,22 +2471,150 @@ nio_conn netio_client_connect_by_address(nio_client nclient, const char *address
 		}
 	}
 
-	memset(&(conn->event), 0, sizeof(struct event));
-	event_set(&(conn->event), conn->soc, EV_READ | EV_PERSIST, __read_event_callback, conn);
-	event_base_set(cli->event_base, &(conn->event));
-	event_add(&(conn->event), NULL);
-
-	conn->close_func = cli->client.close_func;
-	conn->recv_func = cli->client.recv_func;
-	conn->parse_func = cli->client.parse_func;
-	conn->rbuffer.len = 0;
-	conn->rbuffer.next = NULL;
-	conn->parent = cli;
-	conn->pair = NULL;
+	__init_client_conn(cli, conn);
 
 	return (nio_conn)conn;
 }
 
+/**
+ * client pool : 再接続timer callback
+ *
+ * @param int fd
+ * @param short events
+ * @param void *user_data : client_pool_slot_t
+ */
+static void __client_pool_reconnect(int fd, short events, void *user_data)
+{
+	client_pool_slot_t *slot = (client_pool_slot_t *)user_data;
+
+	connection_t *conn = (connection_t *)netio_client_connect(slot->cli);
+	if (conn == NIO_INVALID_HANDLE)
+	{
+		_PRINTF("%s : reconnect failed : %p\n", __func__, slot);
+		__client_pool_schedule(slot);
+		return;
+	}
+	conn->pool_slot = slot;
+	slot->conn = conn;
+}
+
+/**
+ * client pool 解放
+ *
+ * @param tcp_t *cli [in]
+ */
+static void __release_client_pool(tcp_t *cli)
+{
+	int i;
+	for (i = 0; i < cli->client.pool_num; i++)
+	{
+		client_pool_slot_t *slot = &(cli->client.pool[i]);
+		evtimer_del(&(slot->timer));
+		if (slot->conn != NULL)
+		{
+			// 以降の切断では再接続しない
+			slot->conn->pool_slot = NULL;
+		}
+	}
+	FREE(cli->client.pool);
+	cli->client.pool_num = 0;
+}
+
+/**
+ * client pool 開始
+ *
+ * init_clientで指定したaddress, portへのコネクションをnum本接続しておきます。
+ * 切断(接続失敗を含む)されたコネクションは、間隔を空けて自動的に再接続します。
+ * コネクションはnetio_client_pool_getで取得してください
+ *
+ * @param nio_client nclient [in]
+ * @param int num [in] : コネクション数
+ * @return int : 接続を開始したコネクション数 / 失敗:-1
+ */
+int netio_client_pool_start(nio_client nclient, int num)
+{
+	tcp_t *cli = NULL;
+	NETIO_TO_TCP(cli, nclient, -1);
+
+	if ((num <= 0) || (cli->client.pool != NULL))
+	{
+		return -1;
+	}
+	cli->client.pool = (client_pool_slot_t *)calloc(num, sizeof(client_pool_slot_t));
+	if (cli->client.pool == NULL)
+	{
+		_PRINTF("%s : no more alloc : %d\n", __func__, num);
+		return -1;
+	}
+	cli->client.pool_num = num;
+	cli->client.pool_next = 0;
+
+	int i;
+	int count = 0;
+	for (i = 0; i < num; i++)
+	{
+		client_pool_slot_t *slot = &(cli->client.pool[i]);
+		slot->cli = cli;
+		slot->backoff = CLIENT_POOL_BACKOFF_MIN;
+		evtimer_set(&(slot->timer), __client_pool_reconnect, slot);
+		event_base_set(cli->event_base, &(slot->timer));
+
+		// 先に接続しておく
+		connection_t *conn = (connection_t *)netio_client_connect(cli);
+		if (conn == NIO_INVALID_HANDLE)
+		{
+			__client_pool_schedule(slot);
+			continue;
+		}
+		conn->pool_slot = slot;
+		slot->conn = conn;
+		count++;
+	}
+	return count;
+}
+
+/**
+ * client pool からのコネクション取得
+ *
+ * 接続済みのコネクションのうち、送信待ちデータが最も少ないものを返します。
+ * 接続済みのものがなければ接続中のものを返します(送信データは接続までバッファにためられます)
+ *
+ * @param nio_client nclient [in]
+ * @return nio_conn : 使えるコネクションがなければNIO_INVALID_HANDLE
+ */
+nio_conn netio_client_pool_get(nio_client nclient)
+{
+	tcp_t *cli = NULL;
+	NETIO_TO_TCP(cli, nclient, NIO_INVALID_HANDLE);
+
+	connection_t *best = NULL;
+	int best_len = 0;
+	int i;
+	int num = cli->client.pool_num;
+	int start = cli->client.pool_next;
+	for (i = 0; i < num; i++)
+	{
+		// 同じ量なら毎回違うものが選ばれるように、探し始める位置をずらす
+		connection_t *c = cli->client.pool[(start + i) % num].conn;
+		if ((c == NULL) || (c->wm_shut))
+		{
+			continue;
+		}
+		int len = c->wlen + c->rpipe_len;
+		if ((best == NULL) || (best->connecting && !c->connecting) ||
+			((best->connecting == c->connecting) && (len < best_len)))
+		{
+			best = c;
+			best_len = len;
+		}
+	}
+	if (num > 0)
+	{
+		cli->client.pool_next = (start + 1) % num;
+	}
+	return (nio_conn)best;
+}
+
 /**
  * コネクション使用数取得
  *
@@ -1114,6 +2626,16 @@ int netio_tcp_get_conn_use_num(nio_tcp tcp)
 	tcp_t *cli = NULL;
 	NETIO_TO_TCP(cli, tcp, -1);
 
+	if (cli->server.reactor != NULL)
+	{
+		// multi reactor : 全reactorの合計(他threadで更新中のため目安)
+		int i, n = 0;
+		for (i = 0; i < cli->server.n_reactor; i++)
+		{
+			n += get_element_use_num(cli->server.reactor[i]->connection_a);
+		}
+		return n;
+	}
 	return get_element_use_num(cli->connection_a);
 }
 
@@ -1207,65 +2729,189 @@ nio_conn netio_tcp_get_conn_next(nio_tcp tcp, nio_conn c)
  * connection切断
  *
  */
-int netio_tcp_connection_close_all(nio_tcp tcp)
+int netio_tcp_connection_close_all(nio_tcp tcp)
+{
+	tcp_t *t = NULL;
+	NETIO_TO_TCP(t, tcp, 0);
+
+	int count = 0;
+	if (t->connection_a != NULL)
+	{
+		// 有効なコネクションをclose
+		connection_t *c;
+		for (c = get_element_first(t->connection_a); c; c = get_element_next(t->connection_a, c))
+		{
+			if (c->close_func)
+			{
+				// close callbackを呼ぶ
+				c->close_func(c, -2);
+			}
+			CONN_CLEAR(c);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/******************************************************************************
+ * weite bufferへのデータ登録
+ *
+ * @param tcp_t *tcp [in]
+ * @param connection_t *c [in]
+ * @param const char *data [in]
+ * @param int len [in]
+ * @return static int
+ */
+static inline int netio_tcp_append_write_buffer(tcp_t *tcp, connection_t *c, const char *data, int len)
+{
+	write_buffer_t *wb = c->wlast;
+
+	int storedlen = 0;
+	if ((wb != NULL) && (wb->buffer_len < wb->size))
+	{
+		// 最後のbufferの空きに詰める
+		int datalen = MIN(len, wb->size - wb->buffer_len);
+		memcpy(wb->data + wb->buffer_len, data, datalen);
+		wb->buffer_len += datalen;
+		c->wlen += datalen;
+
+		storedlen += datalen;
+		len -= datalen;
+	}
+
+	while (len > 0)
+	{
+		// データが収まる最小のsize classを選ぶ
+		int wclass = 0;
+		while ((wclass < WBUFFER_CLASS_NUM - 1) && (wbuffer_class_size[wclass] < len))
+		{
+			wclass++;
+		}
+		int datalen = MIN(len, wbuffer_class_size[wclass]);
+
+		wb = (write_buffer_t *)pool_alloc(tcp->wbuffer_a[wclass]);
+		if (wb == NULL)
+		{
+			_PRINTF("%s : write_buffer pool_alloc failed : %d\n", __func__, wclass);
+			return 0;
+		}
+
+		memcpy(wb->buffer, data + storedlen, datalen);
+		wb->data = wb->buffer;
+		wb->shared = NULL;
+		wb->wclass = wclass;
+		wb->size = wbuffer_class_size[wclass];
+		wb->buffer_len = datalen;
+		wb->offset = 0;
+		wb->next = NULL;
+
+		// コネクションのlistの最後に追加
+		if (c->wlast != NULL)
+		{
+			c->wlast->next = wb;
+		}
+		else
+		{
+			c->wtop = wb;
+		}
+		c->wlast = wb;
+		c->wlen += datalen;
+
+		storedlen += datalen;
+		len -= datalen;
+		_PRINTF("WBUFF : (%p) %d %d %d\n", c, datalen, storedlen, len);
+	}
+	return 1;
+}
+
+/**
+ * weite bufferの先頭を一つ消去
+ *
+ * @param tcp_t *tcp [in]
+ * @param connection_t *c [in]
+ */
+static inline void netio_tcp_delete_write_buffer_one(tcp_t *tcp, connection_t *c)
+{
+	write_buffer_t *wb = c->wtop;
+
+	c->wtop = wb->next;
+	if (c->wtop == NULL)
+	{
+		c->wlast = NULL;
+	}
+	c->wlen -= (wb->buffer_len - wb->offset);
+	if ((wb->shared != NULL) && (--wb->shared->refcount == 0))
+	{
+		// 最後の参照
+		free(wb->shared);
+	}
+	pool_free(tcp->wbuffer_a[wb->wclass], wb);
+}
+
+/**
+ * weite bufferへの共有payloadの参照の登録
+ *
+ * @param tcp_t *tcp [in]
+ * @param connection_t *c [in]
+ * @param shared_payload_t *shared [in]
+ * @param int offset [in] : 送信済みデータ長さ
+ * @return int : 成功:1 / 失敗:0
+ */
+static inline int netio_tcp_append_write_buffer_shared(tcp_t *tcp, connection_t *c, shared_payload_t *shared, int offset)
 {
-	tcp_t *t = NULL;
-	NETIO_TO_TCP(t, tcp, 0);
-
-	int count = 0;
-	if (t->connection_a != NULL)
+	write_buffer_t *wb = (write_buffer_t *)pool_alloc(tcp->wbuffer_a[WBUFFER_CLASS_SHARED]);
+	if (wb == NULL)
 	{
-		// 有効なコネクションをclose
-		connection_t *c;
-		for (c = get_element_first(t->connection_a); c; c = get_element_next(t->connection_a, c))
-		{
-			if (c->close_func)
-			{
-				// close callbackを呼ぶ
-				c->close_func(c, -2);
-			}
-			CONN_CLEAR(c);
-			count++;
-		}
+		_PRINTF("%s : write_buffer pool_alloc failed\n", __func__);
+		return 0;
 	}
-
-	return count;
+	wb->wclass = WBUFFER_CLASS_SHARED;
+	wb->size = 0; // 後続データは詰めない
+	wb->data = shared->data;
+	wb->shared = shared;
+	wb->buffer_len = shared->len;
+	wb->offset = offset;
+	wb->next = NULL;
+	shared->refcount++;
+
+	// コネクションのlistの最後に追加
+	if (c->wlast != NULL)
+	{
+		c->wlast->next = wb;
+	}
+	else
+	{
+		c->wtop = wb;
+	}
+	c->wlast = wb;
+	c->wlen += shared->len - offset;
+	return 1;
 }
 
-/******************************************************************************
- * weite bufferへのデータ登録
+/**
+ * weite bufferを送信済みbyte数分進める
  *
  * @param tcp_t *tcp [in]
  * @param connection_t *c [in]
- * @param const char *data [in]
- * @param int len [in]
- * @return static int
+ * @param int n [in] : 送信済みbyte数
  */
-static inline int netio_tcp_append_write_buffer(tcp_t *tcp, connection_t *c, const char *data, int len)
+static inline void netio_tcp_advance_write_buffer(tcp_t *tcp, connection_t *c, int n)
 {
-	write_buffer_t *wb = NULL;
-
-	int storedlen = 0;
-	while (len > 0)
+	while ((n > 0) && (c->wtop != NULL))
 	{
-		int datalen = MIN(len, RW_BUFFER_SIZE);
-
-		wb = message_add(tcp->wbuffer_m, (uintptr_t)c);
-		if (wb == NULL)
+		write_buffer_t *wb = c->wtop;
+		int rest = wb->buffer_len - wb->offset;
+		if (n < rest)
 		{
-			_PRINTF("%s : write_buffer message_add failed\n", __func__);
-			return 0;
+			// 送りきれていない：先頭位置をずらすだけ
+			wb->offset += n;
+			c->wlen -= n;
+			return;
 		}
-
-		wb->conn = (nio_conn)c;
-		memcpy(wb->buffer, data + storedlen, datalen);
-		wb->buffer_len = datalen;
-
-		storedlen += datalen;
-		len -= datalen;
-		_PRINTF("WBUFF : (%p) %d %d %d\n", c, datalen, storedlen, len);
+		n -= rest;
+		netio_tcp_delete_write_buffer_one(tcp, c);
 	}
-	return 1;
 }
 
 /**
@@ -1276,33 +2922,61 @@ static inline int netio_tcp_append_write_buffer(tcp_t *tcp, connection_t *c, con
  */
 static void netio_tcp_delete_write_buffer(tcp_t *tcp, connection_t *c)
 {
-	message_del(tcp->wbuffer_m, (uintptr_t)c);
+	while (c->wtop != NULL)
+	{
+		netio_tcp_delete_write_buffer_one(tcp, c);
+	}
+	c->wlen = 0;
 }
 
 /**
  * weite bufferからのデータ送信
  *
- * @param nio_tcp t [in]
- * @param int count [in]
+ * 書き込みバッファはコネクション毎に持っているので、
+ * 送れないコネクションがあっても他のコネクションには影響しない。
+ * たまっているbufferはsendmsgでまとめて送信する。
+ * 送りきったらwrite eventを解除する
+ *
+ * @param connection_t *c [in]
+ * @param int count [in] : 一度に送信するbuffer数の上限
+ * @return int : 送信しきったbuffer数
  */
-static int netio_tcp_push_write_buffer(nio_tcp t, int count)
+static int netio_tcp_push_write_buffer(connection_t *c, int count)
 {
-	tcp_t *tcp = NULL;
+	tcp_t *tcp = (tcp_t *)c->parent;
+	struct iovec iov[_WRITEV_IOV_NUM];
 	int result = 0;
-	NETIO_TO_TCP(tcp, t, 0);
 
-	int i;
-	for (i = 0; i < count; i++)
+	if ((c->rpipe_len > 0) && (__flush_relay_pipe(c) <= 0))
 	{
-		write_buffer_t *wb = message_get_one(tcp->wbuffer_m);
-		if (wb == NULL)
+		// pair relayのデータが先
+		return 0;
+	}
+
+	while (result < count)
+	{
+		if (c->wtop == NULL)
 		{
 			// たまっているものはない
-			return result;
+			break;
+		}
+
+		// 送信するbufferを集める
+		int iovcnt = 0;
+		int total = 0;
+		write_buffer_t *wb;
+		for (wb = c->wtop; wb && (iovcnt < _WRITEV_IOV_NUM) && (result + iovcnt < count); wb = wb->next, iovcnt++)
+		{
+			iov[iovcnt].iov_base = wb->data + wb->offset;
+			iov[iovcnt].iov_len = wb->buffer_len - wb->offset;
+			total += iov[iovcnt].iov_len;
 		}
 
-		connection_t *c = (connection_t *)wb->conn;
-		int n = send(c->soc, wb->buffer, wb->buffer_len, MSG_NOSIGNAL);
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = iovcnt;
+		int n = sendmsg(c->soc, &mh, MSG_NOSIGNAL);
 		if (n < 0)
 		{
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
@@ -1318,23 +2992,25 @@ static int netio_tcp_push_write_buffer(nio_tcp t, int count)
 				strerror_r(errno, tmp, sizeof(tmp));
 				_PRINTF("%s : send failed :%d, %s(%d)\n", __func__, n, tmp, errno);
 #endif
+				// もう送れないので捨てる（切断は受信側で検知する）
+				netio_tcp_delete_write_buffer(tcp, c);
+				__disable_write_event(c);
 				return result;
 			}
 		}
-		_PRINTF("PUSH : %p %d %d\n", c, n, wb->buffer_len);
-		result++;
+		_PRINTF("PUSH : %p %d %d (%d)\n", c, n, total, iovcnt);
 
-		if (n < wb->buffer_len)
+		netio_tcp_advance_write_buffer(tcp, c, n);
+		if (n < total)
 		{
-			// 送りきれていない
-			// データを縮小する
-			wb->buffer_len = wb->buffer_len - n; // 残りbyte数
-			memmove(wb->buffer, wb->buffer + n, wb->buffer_len);
+			// 送りきれていない：書き込み可能になるまで待つ
 			return result;
 		}
-
-		// 成功：bufferから一つ消す
-		message_delete_one(tcp->wbuffer_m);
+		result += iovcnt;
+	}
+	if (c->wtop == NULL)
+	{
+		__disable_write_event(c);
 	}
 	return result;
 }
@@ -1384,10 +3060,16 @@ int netio_sender(nio_conn ncon, char *data, int datalen)
 
 	NETIO_TO_CONNECTION(c, ncon, -2);
 
+	if (c->wm_shut)
+	{
+		// 書き込みバッファの上限を超えて切断待ち
+		return -1;
+	}
+
 	tcp_t *t = c->parent;
-	if (message_find(t->wbuffer_m, (uintptr_t)ncon))
+	if ((c->wtop != NULL) || (c->rpipe_len > 0) || c->connecting)
 	{
-		// バッファにためているものがある
+		// バッファにためているものがある(または接続中)
 		_PRINTF("%s : append_write_buffer 1 : %p %d\n", __func__, c, datalen);
 		// このデータもバッファに入れる
 		if (netio_tcp_append_write_buffer(t, c, data, datalen) == 0)
@@ -1395,6 +3077,10 @@ int netio_sender(nio_conn ncon, char *data, int datalen)
 			_PRINTF("%s : netio_tcp_append_write_buffer failed (%p) %d\n", __func__, c, datalen);
 			return -1;
 		}
+		if (__check_watermark(c) < 0)
+		{
+			return -1;
+		}
 		return datalen;
 	}
 
@@ -1426,11 +3112,301 @@ int netio_sender(nio_conn ncon, char *data, int datalen)
 			_PRINTF("%s : netio_tcp_append_write_buffer failed (%p) %d\n", __func__, c, datalen - n);
 			return -1;
 		}
+		// 書き込み可能になったら送る
+		__enable_write_event(c);
+		if (__check_watermark(c) < 0)
+		{
+			return -1;
+		}
 	}
 
 	return n;
 }
 
+/**
+ * netio データ送信(scatter-gather)
+ *
+ * 複数の領域をまとめて送信する（header + payloadを連結せずに送れる）
+ *
+ * @param nio_conn ncon
+ * @param const struct iovec *iov
+ * @param int iovcnt
+ * @return int : 送信(またはバッファに格納)したデータ長さ
+ */
+int netio_senderv(nio_conn ncon, const struct iovec *iov, int iovcnt)
+{
+	connection_t *c = NULL;
+
+	NETIO_TO_CONNECTION(c, ncon, -2);
+
+	if (c->wm_shut)
+	{
+		// 書き込みバッファの上限を超えて切断待ち
+		return -1;
+	}
+
+	tcp_t *t = c->parent;
+	int i;
+	int datalen = 0;
+	for (i = 0; i < iovcnt; i++)
+	{
+		datalen += iov[i].iov_len;
+	}
+
+	int n = 0;
+	if ((c->wtop == NULL) && (c->rpipe_len == 0) && !c->connecting)
+	{
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = (struct iovec *)iov;
+		mh.msg_iovlen = MIN(iovcnt, IOV_MAX);
+		n = sendmsg(c->soc, &mh, MSG_NOSIGNAL);
+		_PRINTF("%s : sendmsg : %p %d %d\n", __func__, c, datalen, n);
+		if (n < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			{
+				// continue
+				n = 0;
+			}
+			else
+			{
+				// error
+				char tmp[256];
+				strerror_r(errno, tmp, sizeof(tmp));
+				_PRINTF("%s : sendmsg failed :%d, %s(%d)\n", __func__, n, tmp, errno);
+				return n;
+			}
+		}
+		if (n == datalen)
+		{
+			return n;
+		}
+	}
+
+	// 送りきれなかった部分をバッファに入れる
+	int skip = n;
+	for (i = 0; i < iovcnt; i++)
+	{
+		int len = iov[i].iov_len;
+		if (skip >= len)
+		{
+			skip -= len;
+			continue;
+		}
+		if (netio_tcp_append_write_buffer(t, c, (const char *)iov[i].iov_base + skip, len - skip) == 0)
+		{
+			_PRINTF("%s : netio_tcp_append_write_buffer failed (%p) %d\n", __func__, c, len - skip);
+			return -1;
+		}
+		skip = 0;
+	}
+	// 書き込み可能になったら送る
+	__enable_write_event(c);
+	if (__check_watermark(c) < 0)
+	{
+		return -1;
+	}
+
+	return datalen;
+}
+
+/**
+ * IDからコネクションを管理しているreactorを得る
+ *
+ * 親サーバ(multi reactor)が渡された場合は、IDのreactor番号でreactorを選びます
+ *
+ * @param tcp_t *t
+ * @param nio_conn_id id
+ * @return tcp_t * : IDのreactorと異なる場合NULL
+ */
+static inline tcp_t *__tcp_by_conn_id(tcp_t *t, nio_conn_id id)
+{
+	int reactor_index = (int)(id >> CONN_ID_REACTOR_SHIFT);
+	if (t->server.reactor != NULL)
+	{
+		// reactor listは開始前に作られ、以後変わらないのでどのthreadからでも読める
+		return (reactor_index < t->server.n_reactor) ? t->server.reactor[reactor_index] : NULL;
+	}
+	return (reactor_index == t->reactor_index) ? t : NULL;
+}
+
+/**
+ * netio データ送信(他threadから)
+ *
+ * どのthreadからでも呼び出せます。データはコピーしてreactorへ渡し、
+ * reactorのthreadで要求順に送信されます。
+ * コネクションはIDで指定し、reactorのthreadでコネクションに変換します
+ * （呼び出し側のthreadではコネクションに触れないので、切断・再利用中でも安全です）。
+ * 要求から送信までの間にコネクションが切断された場合、データは捨てられます。
+ *
+ * @param nio_tcp tcp [in] : コネクションの生成元(multi reactorの場合は親サーバでも可。IDのreactorへ渡します)
+ * @param nio_conn_id id [in] : netio_conn_get_idで得たID
+ * @param const char *data [in]
+ * @param int datalen [in]
+ * @return int : 要求したデータ長さ / 失敗:-1
+ */
+int netio_sender_async_id(nio_tcp tcp, nio_conn_id id, const char *data, int datalen)
+{
+	tcp_t *t = NULL;
+	NETIO_TO_TCP(t, tcp, -2);
+
+	if (id == NIO_INVALID_CONN_ID)
+	{
+		return -1;
+	}
+	t = __tcp_by_conn_id(t, id);
+	if ((t == NULL) || (t->async_fd < 0))
+	{
+		return -1;
+	}
+
+	async_node_t *node = NULL;
+	if (datalen <= ASYNC_NODE_DATA_SIZE)
+	{
+		node = (async_node_t *)mtpool_alloc(t->async_a);
+		if (node != NULL)
+		{
+			node->pooled = 1;
+		}
+	}
+	if (node == NULL)
+	{
+		node = (async_node_t *)malloc(sizeof(async_node_t) + datalen);
+		if (node == NULL)
+		{
+			_PRINTF("%s : no more alloc : %d\n", __func__, datalen);
+			return -1;
+		}
+		node->pooled = 0;
+	}
+	node->id = id;
+	node->len = datalen;
+	memcpy(node->data, data, datalen);
+
+	// listの先頭に追加
+	async_node_t *head = __atomic_load_n(&(t->async_head), __ATOMIC_RELAXED);
+	do
+	{
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(&(t->async_head), &head, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (head == NULL)
+	{
+		// 空から積まれた時だけreactorを起こす
+		uint64_t val = 1;
+		if (write(t->async_fd, &val, sizeof(val)) < 0)
+		{
+			_PRINTF("%s : write failed : %d\n", __func__, errno);
+		}
+	}
+
+	return datalen;
+}
+
+/**
+ * netio 全コネクションへの送信
+ *
+ * すぐに送りきれなかったコネクションには、データを1つの共有payloadに格納して
+ * その参照を書き込みバッファに積みます（コネクション毎のコピーは行いません）。
+ * multi reactorの親サーバには使えません（各reactorのthreadから、reactorに対して呼んでください）。
+ *
+ * @param nio_tcp ntcp [in] : nio_server, nio_client
+ * @param const char *data [in]
+ * @param int datalen [in]
+ * @param broadcast_filter filter [in] : 送信先の選択(戻り値が負のコネクションには送らない)。NULLなら全コネクション
+ * @return int : 送信(またはバッファに格納)したコネクション数 / 失敗:-1
+ */
+int netio_broadcast(nio_tcp ntcp, const char *data, int datalen, broadcast_filter filter)
+{
+	tcp_t *t = NULL;
+	NETIO_TO_TCP(t, ntcp, -1);
+
+	if ((t->server.reactor != NULL) || (t->connection_a == NULL) || (datalen <= 0))
+	{
+		return -1;
+	}
+
+	shared_payload_t *shared = NULL;
+	int count = 0;
+	connection_t *c, *next;
+	for (c = get_element_first(t->connection_a); c; c = next)
+	{
+		next = get_element_next(t->connection_a, c); // watermark callback内での切断に備えて先に取得
+		if ((c->soc < 0) || c->wm_shut)
+		{
+			continue;
+		}
+		if ((filter != NULL) && (filter(c) < 0))
+		{
+			continue;
+		}
+
+		int n = 0;
+		if ((c->wtop == NULL) && (c->rpipe_len == 0) && !c->connecting)
+		{
+			n = send(c->soc, data, datalen, MSG_NOSIGNAL);
+			if (n < 0)
+			{
+				if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+				{
+					// error（切断は受信側で検知する）
+					_PRINTF("%s : send failed : %p %d\n", __func__, c, errno);
+					continue;
+				}
+				n = 0;
+			}
+			if (n == datalen)
+			{
+				count++;
+				continue;
+			}
+		}
+
+		// 送りきれていない
+		if (datalen - n <= WBUFFER_SMALL_SIZE)
+		{
+			// 小さいものはコピーした方が安い
+			if (netio_tcp_append_write_buffer(t, c, data + n, datalen - n) == 0)
+			{
+				continue;
+			}
+		}
+		else
+		{
+			if (shared == NULL)
+			{
+				shared = (shared_payload_t *)malloc(sizeof(shared_payload_t) + datalen);
+				if (shared == NULL)
+				{
+					_PRINTF("%s : no more alloc : %d\n", __func__, datalen);
+					return -1;
+				}
+				shared->refcount = 1; // 送信中はここで参照を持つ（watermarkでの切断で途中解放されないように）
+				shared->len = datalen;
+				memcpy(shared->data, data, datalen);
+			}
+			if (netio_tcp_append_write_buffer_shared(t, c, shared, n) == 0)
+			{
+				continue;
+			}
+		}
+		// 書き込み可能になったら送る
+		__enable_write_event(c);
+		if (__check_watermark(c) < 0)
+		{
+			continue;
+		}
+		count++;
+	}
+
+	if ((shared != NULL) && (--shared->refcount == 0))
+	{
+		free(shared);
+	}
+	return count;
+}
+
 /**
  * netio データ送信
  *
@@ -1465,28 +3441,100 @@ int netio_sender_old(nio_conn ncon, char *data, int datalen)
 		len -= n;
 		pdata += n;
 	}
-	return datalen;
+	return datalen;
+}
+
+/**
+ * connection切断
+ *
+ * @param nio_conn ncon [in]
+ * @return int
+ */
+int netio_connection_close(nio_conn ncon)
+{
+	connection_t *c = NULL;
+	NETIO_TO_CONNECTION(c, ncon, 0);
+
+	if (c->close_func != NULL)
+	{
+		// close callback が指定されていたらcallbackを呼び出す
+		c->close_func(ncon, -3);
+	}
+	CONN_CLEAR(c); // いきなり切断される。問題が起こるようなら後ほど修正します
+
+	return 1;
+}
+
+/**
+ * コネクションIDの取得
+ *
+ * IDはreactor番号、コネクションpool内の位置とgenerationからなり、
+ * 切断後に同じ位置が再利用されても別のIDになります。
+ * reactor番号を含むので、multi reactorの場合も親サーバだけでコネクションを特定できます
+ *
+ * @param nio_conn ncon [in]
+ * @return nio_conn_id : 切断済みの場合NIO_INVALID_CONN_ID
+ */
+nio_conn_id netio_conn_get_id(nio_conn ncon)
+{
+	connection_t *c = NULL;
+	NETIO_TO_CONNECTION(c, ncon, NIO_INVALID_CONN_ID);
+
+	if (c->soc < 0)
+	{
+		return NIO_INVALID_CONN_ID;
+	}
+	tcp_t *t = (tcp_t *)c->parent;
+	int index = pool_get_index(t->connection_a, c);
+	if (index < 0)
+	{
+		return NIO_INVALID_CONN_ID;
+	}
+	unsigned int block = (unsigned int)index >> POOL_INDEX_BLOCK_SHIFT;
+	unsigned int offset = (unsigned int)index & POOL_INDEX_ELEMENT_MASK;
+	if ((block >= (1 << CONN_ID_BLOCK_BITS)) || (offset >= (1 << CONN_ID_OFFSET_BITS)))
+	{
+		_PRINTF("%s : index out of range : %x\n", __func__, index);
+		return NIO_INVALID_CONN_ID;
+	}
+	return ((nio_conn_id)t->reactor_index << CONN_ID_REACTOR_SHIFT) |
+		   ((nio_conn_id)((block << CONN_ID_OFFSET_BITS) | offset) << 32) |
+		   c->generation;
 }
 
 /**
- * connection切断
+ * コネクションIDからコネクションを得る
  *
- * @param nio_conn ncon [in]
- * @return int
+ * multi reactorの場合は親サーバ、コネクションのreactorのどちらを指定しても構いません
+ * （コネクションを参照できるのはそのreactorのthreadだけです）
+ *
+ * @param nio_tcp tcp [in] : コネクションの生成元(multi reactorの場合は親サーバでも可)
+ * @param nio_conn_id id [in] : netio_conn_get_idで得たID
+ * @return nio_conn : 切断済み(再利用済み)の場合NIO_INVALID_HANDLE
  */
-int netio_connection_close(nio_conn ncon)
+nio_conn netio_conn_from_id(nio_tcp tcp, nio_conn_id id)
 {
-	connection_t *c = NULL;
-	NETIO_TO_CONNECTION(c, ncon, 0);
+	tcp_t *t = NULL;
+	NETIO_TO_TCP(t, tcp, NIO_INVALID_HANDLE);
 
-	if (c->close_func != NULL)
+	if (id == NIO_INVALID_CONN_ID)
 	{
-		// close callback が指定されていたらcallbackを呼び出す
-		c->close_func(ncon, -3);
+		return NIO_INVALID_HANDLE;
 	}
-	CONN_CLEAR(c); // いきなり切断される。問題が起こるようなら後ほど修正します
-
-	return 1;
+	t = __tcp_by_conn_id(t, id);
+	if ((t == NULL) || (t->connection_a == NULL))
+	{
+		return NIO_INVALID_HANDLE;
+	}
+	unsigned int pos = (unsigned int)(id >> 32);
+	int block = (pos >> CONN_ID_OFFSET_BITS) & ((1 << CONN_ID_BLOCK_BITS) - 1);
+	int offset = pos & ((1 << CONN_ID_OFFSET_BITS) - 1);
+	connection_t *c = (connection_t *)pool_get_element_by_index(t->connection_a, (block << POOL_INDEX_BLOCK_SHIFT) | offset);
+	if ((c == NULL) || (c->soc < 0) || (c->generation != (unsigned int)(id & 0xffffffff)))
+	{
+		return NIO_INVALID_HANDLE;
+	}
+	return (nio_conn)c;
 }
 
 /**
@@ -1582,27 +3630,15 @@ char *netio_connection_get_host_address(nio_conn ncon, char *buff, int len)
 /**
  * 使用中書き込みバッファの長さを取得
  *
- * sizeof(wb->buffer)以上のサイズはだたしく得ることができません
- *
  * @param nio_conn ncon [in]
- * @return int
+ * @return int : 送信待ちのbyte数
  */
 int netio_connection_get_wbuff_len(nio_conn ncon)
 {
 	connection_t *c = NULL;
 	NETIO_TO_CONNECTION(c, ncon, 0);
-	tcp_t *t = c->parent;
-	if (t == NULL)
-	{
-		assert(0);
-		return 0;
-	}
-	write_buffer_t *wb = message_find(t->wbuffer_m, (uintptr_t)ncon);
-	if (wb != NULL)
-	{
-		return wb->buffer_len;
-	}
-	return 0;
+
+	return c->wlen + c->rpipe_len; // pair relayのpipe内のデータも含む
 }
 
 /**
@@ -1690,6 +3726,98 @@ void netio_server_set_parse_callback(nio_server nsv, parse_callback callback)
 	server->server.listen_conn.parse_func = callback;
 }
 
+/**
+ * netio server frame parse コールバック設定
+ *
+ * parse callbackと両方設定されている場合はこちらが優先されます
+ *
+ * @param nio_server nsv [in] :
+ * @param  frame_callback callback [in] :
+ */
+void netio_server_set_frame_callback(nio_server nsv, frame_callback callback)
+{
+	tcp_t *server = NULL;
+	NETIO_TO_TCP(server, nsv, );
+
+	server->server.listen_conn.frame_func = callback;
+}
+
+/**
+ * netio server 読み込み量設定
+ *
+ * 1回の受信イベントで、EAGAINになるかこの量に達するまで読み込みます
+ *
+ * @param nio_server nsv [in] :
+ * @param int bytes [in] : byte数 (0:制限なし)
+ * @param int frames [in] : recv callbackを呼び出す回数 (0:制限なし)
+ */
+void netio_server_set_read_budget(nio_server nsv, int bytes, int frames)
+{
+	tcp_t *server = NULL;
+	NETIO_TO_TCP(server, nsv, );
+
+	server->read_budget_bytes = bytes;
+	server->read_budget_frames = frames;
+}
+
+/**
+ * netio server 受信frame最大長さ設定
+ *
+ * parse callback / frame callback使用時、これより長いframeを受信しようとしたコネクションは
+ * 切断します（close callbackにはEMSGSIZEが渡されます）
+ *
+ * @param nio_server nsv [in] :
+ * @param int bytes [in] : byte数 (0:制限なし)
+ */
+void netio_server_set_max_frame_size(nio_server nsv, int bytes)
+{
+	tcp_t *server = NULL;
+	NETIO_TO_TCP(server, nsv, );
+
+	server->max_frame_size = bytes;
+}
+
+/**
+ * netio server 書き込みバッファwatermark設定
+ *
+ * 以降にacceptしたコネクションに適用されます。
+ * 書き込みバッファ使用量がhighを超えたらcallback(conn, NIO_WATERMARK_HIGH)、
+ * その後low以下に戻ったらcallback(conn, NIO_WATERMARK_LOW)が呼ばれます。
+ * limitを超えたらバッファを捨てて切断します（close callbackにはENOBUFSが渡されます）
+ *
+ * @param nio_server nsv [in] :
+ * @param int low [in] : low watermark(byte)
+ * @param int high [in] : high watermark(byte, 0:無効)
+ * @param int limit [in] : 上限(byte, 0:無効)
+ * @param watermark_callback callback [in] :
+ */
+void netio_server_set_watermark(nio_server nsv, int low, int high, int limit, watermark_callback callback)
+{
+	tcp_t *server = NULL;
+	NETIO_TO_TCP(server, nsv, );
+
+	server->server.listen_conn.wm_low = low;
+	server->server.listen_conn.wm_high = high;
+	server->server.listen_conn.wm_limit = limit;
+	server->server.listen_conn.wm_func = callback;
+}
+
+/**
+ * netio server accept数設定
+ *
+ * 1回のacceptイベントで、EAGAINになるかこの数に達するまでacceptします
+ *
+ * @param nio_server nsv [in] :
+ * @param int num [in] : accept数 (0:制限なし)
+ */
+void netio_server_set_accept_budget(nio_server nsv, int num)
+{
+	tcp_t *server = NULL;
+	NETIO_TO_TCP(server, nsv, );
+
+	server->server.accept_budget = num;
+}
+
 /**
  * netio client受信コールバック設定
  *
@@ -1732,6 +3860,113 @@ void netio_client_set_parse_callback(nio_client ncl, parse_callback callback)
 	client->client.parse_func = callback;
 }
 
+/**
+ * netio client frame parse コールバック設定
+ *
+ * parse callbackと両方設定されている場合はこちらが優先されます
+ *
+ * @param nio_client ncl [in] :
+ * @param frame_callback callback [in] :
+ */
+void netio_client_set_frame_callback(nio_client ncl, frame_callback callback)
+{
+	tcp_t *client = NULL;
+	NETIO_TO_TCP(client, ncl, );
+
+	client->client.frame_func = callback;
+}
+
+/**
+ * netio client 読み込み量設定
+ *
+ * 1回の受信イベントで、EAGAINになるかこの量に達するまで読み込みます
+ *
+ * @param nio_client ncl [in] :
+ * @param int bytes [in] : byte数 (0:制限なし)
+ * @param int frames [in] : recv callbackを呼び出す回数 (0:制限なし)
+ */
+void netio_client_set_read_budget(nio_client ncl, int bytes, int frames)
+{
+	tcp_t *client = NULL;
+	NETIO_TO_TCP(client, ncl, );
+
+	client->read_budget_bytes = bytes;
+	client->read_budget_frames = frames;
+}
+
+/**
+ * netio client 受信frame最大長さ設定
+ *
+ * parse callback / frame callback使用時、これより長いframeを受信しようとしたコネクションは
+ * 切断します（close callbackにはEMSGSIZEが渡されます）
+ *
+ * @param nio_client ncl [in] :
+ * @param int bytes [in] : byte数 (0:制限なし)
+ */
+void netio_client_set_max_frame_size(nio_client ncl, int bytes)
+{
+	tcp_t *client = NULL;
+	NETIO_TO_TCP(client, ncl, );
+
+	client->max_frame_size = bytes;
+}
+
+/**
+ * netio client 接続完了コールバック設定
+ *
+ * 接続が完了したらcallback(conn, 0)、失敗・タイムアウトしたらcallback(conn, errno)が呼ばれます。
+ * 失敗時はcallbackの後でコネクションが解放されます（close callbackは呼ばれません）。
+ * 未設定の場合、失敗時にはclose callbackが呼ばれます
+ *
+ * @param nio_client ncl [in] :
+ * @param connect_callback callback [in] :
+ */
+void netio_client_set_connect_callback(nio_client ncl, connect_callback callback)
+{
+	tcp_t *client = NULL;
+	NETIO_TO_TCP(client, ncl, );
+
+	client->client.connect_func = callback;
+}
+
+/**
+ * netio client 接続タイムアウト設定
+ *
+ * 時間内に接続できなければ、ETIMEDOUTで失敗したものとして扱います
+ *
+ * @param nio_client ncl [in] :
+ * @param int msec [in] : タイムアウト(msec, 0:なし)
+ */
+void netio_client_set_connect_timeout(nio_client ncl, int msec)
+{
+	tcp_t *client = NULL;
+	NETIO_TO_TCP(client, ncl, );
+
+	client->client.connect_timeout = msec;
+}
+
+/**
+ * netio client 書き込みバッファwatermark設定
+ *
+ * 以降に接続したコネクションに適用されます（netio_server_set_watermark参照）
+ *
+ * @param nio_client ncl [in] :
+ * @param int low [in] : low watermark(byte)
+ * @param int high [in] : high watermark(byte, 0:無効)
+ * @param int limit [in] : 上限(byte, 0:無効)
+ * @param watermark_callback callback [in] :
+ */
+void netio_client_set_watermark(nio_client ncl, int low, int high, int limit, watermark_callback callback)
+{
+	tcp_t *client = NULL;
+	NETIO_TO_TCP(client, ncl, );
+
+	client->client.wm_low = low;
+	client->client.wm_high = high;
+	client->client.wm_limit = limit;
+	client->client.wm_func = callback;
+}
+
 /**
  * netio connction受信コールバック設定
  *
@@ -1786,6 +4021,24 @@ parse_callback netio_conn_set_parse_callback(nio_conn ncon, parse_callback callb
 	return old_callback;
 }
 
+/**
+ * netio frame parseコールバック設定
+ *
+ * @param nio_conn ncon [in] :
+ * @param frame_callback callback [in] :
+ * @return frame_callback
+ */
+frame_callback netio_conn_set_frame_callback(nio_conn ncon, frame_callback callback)
+{
+	connection_t *c = NULL;
+	NETIO_TO_CONNECTION(c, ncon, NULL);
+
+	frame_callback old_callback = c->frame_func;
+	c->frame_func = callback;
+
+	return old_callback;
+}
+
 /**
  * netio connction受信可否チェック関数設定
  *
@@ -1804,6 +4057,44 @@ recv_check_func netio_conn_set_recv_check_func(nio_conn ncon, recv_check_func ch
 	return old_checkfunc;
 }
 
+/**
+ * netio connection 接続完了コールバック設定
+ *
+ * @param nio_conn ncon [in] :
+ * @param connect_callback callback [in] :
+ * @return connect_callback
+ */
+connect_callback netio_conn_set_connect_callback(nio_conn ncon, connect_callback callback)
+{
+	connection_t *c = NULL;
+	NETIO_TO_CONNECTION(c, ncon, NULL);
+
+	connect_callback old_callback = c->connect_func;
+	c->connect_func = callback;
+
+	return old_callback;
+}
+
+/**
+ * netio connection 書き込みバッファwatermark設定
+ *
+ * @param nio_conn ncon [in] :
+ * @param int low [in] : low watermark(byte)
+ * @param int high [in] : high watermark(byte, 0:無効)
+ * @param int limit [in] : 上限(byte, 0:無効)
+ * @param watermark_callback callback [in] :
+ */
+void netio_conn_set_watermark(nio_conn ncon, int low, int high, int limit, watermark_callback callback)
+{
+	connection_t *c = NULL;
+	NETIO_TO_CONNECTION(c, ncon, );
+
+	c->wm_low = low;
+	c->wm_high = high;
+	c->wm_limit = limit;
+	c->wm_func = callback;
+}
+
 /**
  * netio pair connction設定
  *
@@ -1819,12 +4110,52 @@ void netio_conn_set_pair_connection(nio_conn ncon, nio_conn pair_conn)
 	connection_t *pairc = NULL;
 	NETIO_TO_CONNECTION(pairc, pair_conn, );
 
-	// 片方向
+	__unlink_pair(c);
+
+	// 片方向（中継先の切断は、中継する時にgenerationで検出する）
 	c->pair = pairc;
+	c->pair_generation = pairc->generation;
 
 	return;
 }
 
+/**
+ * 双方向のPair connection設定
+ *
+ * 互いに受信したデータを相手に中継します。
+ * 中継先の送信待ちが一定量を超えたら中継元の読み込みを止め、はけたら再開するので、
+ * 速度差があっても中継に使うメモリは一定量に収まります。
+ * どちらかが切断されたら、もう一方の中継も解除されます。
+ * 同じthread(event_base)のコネクション同士で使ってください
+ *
+ * @param nio_conn na [in]
+ * @param nio_conn nb [in]
+ * @return int : 成功:1 / 失敗:0
+ */
+int netio_conn_pair(nio_conn na, nio_conn nb)
+{
+	connection_t *a = NULL;
+	NETIO_TO_CONNECTION(a, na, 0);
+	connection_t *b = NULL;
+	NETIO_TO_CONNECTION(b, nb, 0);
+
+	if ((a == b) || (a->soc < 0) || (b->soc < 0))
+	{
+		return 0;
+	}
+
+	__unlink_pair(a);
+	__unlink_pair(b);
+	a->pair = b;
+	b->pair = a;
+	a->pair_generation = b->generation;
+	b->pair_generation = a->generation;
+	a->pair_linked = 1;
+	b->pair_linked = 1;
+
+	return 1;
+}
+
 /***********************************************************************/
 /****** multicast *****/
 
@@ -2489,6 +4820,32 @@ int netio_parse16(const char *data, int datalen, char *parsed_data, int *parsed_
 	return (len + sizeof(uint16_t));
 }
 
+int netio_frame16(const char *data, int datalen, int *frame_offset, int *frame_len)
+{
+	*frame_offset = 0;
+	*frame_len = 0;
+	// 16bit length parser (コピーなし)
+	if ((unsigned int)datalen <= sizeof(uint16_t))
+	{
+		// データが届ききっていない
+		return 0;
+	}
+
+	uint16_t tmplen = 0;
+	memcpy(&tmplen, data, sizeof(uint16_t));
+	int len = ntohs(tmplen);
+
+	if ((len + sizeof(uint16_t)) > (unsigned int)datalen)
+	{
+		// データが届ききっていない
+		return 0;
+	}
+
+	*frame_offset = sizeof(uint16_t);
+	*frame_len = len;
+	return (len + sizeof(uint16_t));
+}
+
 int netio_pack16_length(char *pack_data, int datalen)
 {
 	uint16_t len = (uint16_t)datalen;
@@ -2550,6 +4907,40 @@ int netio_parse32(const char *data, int datalen, char *parsed_data, int *parsed_
 	return (int)(len + sizeof(uint32_t));
 }
 
+int netio_frame32(const char *data, int datalen, int *frame_offset, int *frame_len)
+{
+	*frame_offset = 0;
+	*frame_len = 0;
+
+	// 32bit length parser (コピーなし、int=32bitの環境では実質使えるのは31bit)
+	if ((unsigned int)datalen <= sizeof(uint32_t))
+	{
+		// データが届ききっていない
+		return 0;
+	}
+
+	uint32_t tmplen = 0;
+	uint32_t len = 0;
+	memcpy(&tmplen, data, sizeof(uint32_t));
+	len = ntohl(tmplen);
+
+	if (len > (uint32_t)(INT_MAX - sizeof(uint32_t)))
+	{
+		// 扱えない長さ
+		*frame_len = -1;
+		return -1;
+	}
+	if (((unsigned int)len + sizeof(uint32_t)) > (unsigned int)datalen)
+	{
+		// データが届ききっていない
+		return 0;
+	}
+
+	*frame_offset = sizeof(uint32_t);
+	*frame_len = (int)len;
+	return (int)(len + sizeof(uint32_t));
+}
+
 int netio_pack32_length(char *pack_data, int datalen)
 {
 	uint32_t len = (uint32_t)datalen;
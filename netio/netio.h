@@ -15,6 +15,8 @@ extern "C"
 #endif
 
 #include <netinet/in.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
   //=======================================================================/
 
@@ -33,6 +35,9 @@ extern "C"
   typedef void *nio_udp;
   typedef void *nio_raw;
 
+  typedef uint64_t nio_conn_id; // コネクションID(reactor番号 | pool内の位置 | generation)
+#define NIO_INVALID_CONN_ID 0 // 無効なnio_conn_id
+
   //=======================================================================/
 
   // 初期化
@@ -48,12 +53,22 @@ extern "C"
   nio_server netio_init_server(unsigned short listen_port, unsigned int tcpbuffsize, unsigned int conbuffsize, void *group); // 初期化
   void netio_release_server(nio_server s);                                                                                   // 解放
 
+  // サーバ(multi reactor)
+  nio_server netio_init_server_mt(unsigned short listen_port, int nthreads, unsigned int tcpbuffsize, unsigned int conbuffsize); // 初期化
+  int netio_server_start(nio_server s);                                                                                          // reactor thread開始
+  int netio_server_get_reactor_num(nio_server s);                                                                                // reactor数
+  nio_server netio_server_get_reactor(nio_server s, int index);                                                                  // reactor取得
+
   // クライアント
   nio_client netio_init_client(const char *address, unsigned short port, unsigned int tcpbuffsize, unsigned int conbuffsize, void *group); // 初期化
   void netio_release_client(nio_client tcp);                                                                                               // 解放
   nio_conn netio_client_connect(nio_client client);                                                                                        // 接続
   nio_conn netio_client_connect_by_address(nio_client nclient, const char *address, unsigned short port);                                  // 接続(address,port指定)
 
+  // クライアント(コネクションpool)
+  int netio_client_pool_start(nio_client client, int num); // num本接続しておく（切断されたら再接続）
+  nio_conn netio_client_pool_get(nio_client client);       // 送信待ちが最も少ないコネクションを取得
+
   // サーバ・クライアント共通
   char *netio_tcp_get_address(nio_tcp tcp, char *buff, int len); // 設定されているアドレス:ポートを取得
   void netio_tcp_get_ip(nio_tcp tcp, char *buff, int len);       // 設定されているアドレスを取得
@@ -73,7 +88,15 @@ extern "C"
   nio_server netio_init_group(void);
 
   // コネクション
-  int netio_sender(nio_conn conn, char *data, int datalen); // 送信
+  int netio_sender(nio_conn conn, char *data, int datalen);                  // 送信
+  int netio_senderv(nio_conn conn, const struct iovec *iov, int iovcnt); // 送信(scatter-gather)
+
+  // 送信(他threadから。コネクションはIDで指定する)
+  int netio_sender_async_id(nio_tcp tcp, nio_conn_id id, const char *data, int datalen);
+
+  // 全コネクションへの送信（送りきれないコネクションにはデータを共有して積む）
+  typedef int (*broadcast_filter)(nio_conn conn); // 負を返したコネクションには送らない
+  int netio_broadcast(nio_tcp tcp, const char *data, int datalen, broadcast_filter filter);
 
   int netio_connection_close(nio_conn conn);         // 切断（close callbackは呼ばれません）
   int netio_connection_is_valid(nio_conn ncon);      // 有効性のテスト
@@ -81,6 +104,10 @@ extern "C"
   nio_tcp netio_get_tcp_by_conn(nio_conn ncon);      // コネクションの生成元nio_tcp(= nio_server or nio_client)を取得
   int netio_connection_get_wbuff_len(nio_conn ncon); // コネクションの書き込み保存バッファ使用量を取得
 
+  // コネクションID（切断・再利用の検出ができる。アプリケーション側で保持する場合に使用）
+  nio_conn_id netio_conn_get_id(nio_conn ncon);             // IDの取得
+  nio_conn netio_conn_from_id(nio_tcp tcp, nio_conn_id id); // IDからコネクションを得る（切断済みならNIO_INVALID_HANDLE）
+
   // アドレス情報を取得
   char *netio_connection_get_remote_address(nio_conn ncon, char *buff, int len);
   char *netio_connection_get_host_address(nio_conn ncon, char *buff, int len);
@@ -90,27 +117,47 @@ extern "C"
   typedef int (*close_callback)(nio_conn conn, int result);
   typedef int (*recv_callback)(nio_conn conn, char *data, int datalen);
   typedef int (*parse_callback)(const char *data, int datalen, char *parsed_data, int *max_parsed_data);
+  typedef int (*frame_callback)(const char *data, int datalen, int *frame_offset, int *frame_len); // frameの位置だけを返すparser(recv_callbackには受信バッファ上のframeが渡されます)
   typedef int (*recv_check_func)(nio_conn conn);
   typedef int (*accept_check_func)(nio_server sv);
+  typedef int (*connect_callback)(nio_conn conn, int result); // result : 0:接続完了 / errno(ETIMEDOUT等):失敗
+  typedef int (*watermark_callback)(nio_conn conn, int state); // state : NIO_WATERMARK_*
+#define NIO_WATERMARK_LOW 0  // 書き込みバッファがlow watermark以下に戻った
+#define NIO_WATERMARK_HIGH 1 // 書き込みバッファがhigh watermarkを超えた
 
   // 各種コールバック設定
   void netio_server_set_accept_callback(nio_server sv, accept_callback callback);       // サーバaccept
   void netio_server_set_recv_callback(nio_server sv, recv_callback callback);           // サーバデータ受信
   void netio_server_set_close_callback(nio_server sv, close_callback callback);         // サーバconnection close
   void netio_server_set_parse_callback(nio_server nsv, parse_callback callback);        // サーバデータparse
+  void netio_server_set_frame_callback(nio_server nsv, frame_callback callback);        // サーバデータparse(コピーなし)
   void netio_server_set_accept_check_func(nio_server nsv, accept_check_func checkfunc); // サーバaccept可否チェック
+  void netio_server_set_read_budget(nio_server nsv, int bytes, int frames);             // サーバ1回のイベントでの読み込み量
+  void netio_server_set_max_frame_size(nio_server nsv, int bytes);                       // サーバ受信frame最大長さ
+  void netio_server_set_accept_budget(nio_server nsv, int num);                          // サーバ1回のイベントでのaccept数
+  void netio_server_set_watermark(nio_server nsv, int low, int high, int limit, watermark_callback callback); // サーバ書き込みバッファwatermark
   void netio_client_set_recv_callback(nio_client cl, recv_callback callback);           // クライアントデータ受信
   void netio_client_set_close_callback(nio_client cl, close_callback callback);         // クライアントconnection close
   void netio_client_set_parse_callback(nio_client ncl, parse_callback callback);        // クライアントデータparse
+  void netio_client_set_frame_callback(nio_client ncl, frame_callback callback);        // クライアントデータparse(コピーなし)
+  void netio_client_set_read_budget(nio_client ncl, int bytes, int frames);             // クライアント1回のイベントでの読み込み量
+  void netio_client_set_max_frame_size(nio_client ncl, int bytes);                       // クライアント受信frame最大長さ
+  void netio_client_set_connect_callback(nio_client ncl, connect_callback callback);   // クライアント接続完了
+  void netio_client_set_connect_timeout(nio_client ncl, int msec);                      // クライアント接続タイムアウト
+  void netio_client_set_watermark(nio_client ncl, int low, int high, int limit, watermark_callback callback); // クライアント書き込みバッファwatermark
 
   // コネクションへのコールバック設定
   recv_callback netio_conn_set_recv_callback(nio_conn conn, recv_callback callback);        // コネクションデータ受信
   close_callback netio_conn_set_close_callback(nio_conn conn, close_callback callback);     // コネクションclose
   parse_callback netio_conn_set_parse_callback(nio_conn ncon, parse_callback callback);     // データparse
+  frame_callback netio_conn_set_frame_callback(nio_conn ncon, frame_callback callback);     // データparse(コピーなし)
   recv_check_func netio_conn_set_recv_check_func(nio_conn ncon, recv_check_func checkfunc); // 受信可否チェック
+  connect_callback netio_conn_set_connect_callback(nio_conn ncon, connect_callback callback); // 接続完了
+  void netio_conn_set_watermark(nio_conn ncon, int low, int high, int limit, watermark_callback callback);    // 書き込みバッファwatermark
 
   // Pair connection設定
-  void netio_conn_set_pair_connection(nio_conn ncon, nio_conn pair_conn);
+  void netio_conn_set_pair_connection(nio_conn ncon, nio_conn pair_conn); // 片方向
+  int netio_conn_pair(nio_conn a, nio_conn b);                           // 双方向(流量制御あり)
 
   //=======================================================================/
   /* Multicast ***/
@@ -165,10 +212,12 @@ extern "C"
   /* PARSER ***/
 
   int netio_parse16(const char *data, int datalen, char *parsed_data, int *parsed_data_len);
+  int netio_frame16(const char *data, int datalen, int *frame_offset, int *frame_len);
   int netio_pack16_length(char *pack_data, int datalen);
   int netio_pack16(const char *data, int datalen, char *pack_data, int max_pack_data);
 
   int netio_parse32(const char *data, int datalen, char *parsed_data, int *parsed_data_len);
+  int netio_frame32(const char *data, int datalen, int *frame_offset, int *frame_len);
   int netio_pack32_length(char *pack_data, int datalen);
   int netio_pack32(const char *data, int datalen, char *pack_data, int max_pack_data);
 
@@ -1,6 +1,11 @@
 #if !defined(__POOLALLOC_H_INCLUDED__)
 #define __POOLALLOC_H_INCLUDED__
 
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -11,10 +16,32 @@ extern "C"
     // ・足りなくなったら自動で拡張します(reallocを使います)
     // ・pool内は固定サイズのelementのリストになっています。異なるサイズの要素は、別のpoolを確保してください。
     // ・可変長データは扱えません
+    // ・使用中要素の走査は、使用中要素のないblockを飛ばします
+    // ・POOL_OPT_BITMAPを指定すると、element headerを持たず使用状態をblock毎のbitmapで管理します
+    //   (小さい要素向け。dataは詰めて、cache line境界から配置されます。
+    //    使用中要素の走査はbitmapを64要素ずつ調べるので、頻繁に走査するpoolにも向いています)
+    // ・POOL_OPT_HUGEPAGEを指定すると、blockを2MBのhuge pageで確保します
+    //   (hugetlbfsが使えなければTHPをmadviseで要求します。余った領域も要素として使います)
+    // ・POOL_OPT_PREFAULTを指定すると、block確保時にpage faultを済ませておきます
+    // ・pool_grow_aheadで、使い切る前に拡張しておくことができます
+    // ・pool_trimで、全要素が未使用のblockを解放できます（最初のblockは解放しません）
+    // ・要素はpool内のindex(pool_get_index)で表せ、indexから要素を直接得られます
+
+#define POOL_OPT_BITMAP 0x01   // bitmapで使用状態を管理する
+#define POOL_OPT_HUGEPAGE 0x02 // blockをhuge pageで確保する
+#define POOL_OPT_PREFAULT 0x04 // block確保時にpage faultさせておく
+
+#define POOL_HUGEPAGE_SIZE (2 * 1024 * 1024) // huge pageのサイズ
+
+#define POOL_INDEX_BLOCK_SHIFT 24                                   // index : block index(上位) | block内index(下位24bit)
+#define POOL_INDEX_ELEMENT_MASK ((1 << POOL_INDEX_BLOCK_SHIFT) - 1) // index : block内indexのmask
+
+#define POOL_CACHE_LINE 64 // bitmap pool : block先頭のalign
 
     typedef struct _memelement_t
     {
         int in_use;                 // 使用済みflag
+        int block;                  // 所属block index
         struct _memelement_t *next; // 次要素(未使用list用)
         char data[0];               // ユーザデータ
     } memelement_t;
@@ -23,6 +50,15 @@ extern "C"
     {
         int num;               // block内の個数
         memelement_t *element; // elementのリスト
+        size_t bytes;          // 確保した領域のサイズ
+        int mapped;            // mmapで確保したか
+        int use_num;           // block内の使用数(POOL_OPT_BITMAPではnum - n_free)
+
+        // POOL_OPT_BITMAP
+        char *base;       // data領域(cache line align)
+        uint64_t *bitmap; // 使用中bitmap
+        int *free_idx;    // 未使用index stack
+        int n_free;       // 未使用数
     } memblock_t;
 
     typedef struct
@@ -31,12 +67,16 @@ extern "C"
         int use_num;           // elementの使用数
         int max_num;           // 確保可能なelementの最大数
         int size;              // dataのサイズ
+        int flags;             // POOL_OPT_*
+        int stride;            // POOL_OPT_BITMAP : element間隔
+        int free_block;        // POOL_OPT_BITMAP : 空きのあるblock(検索開始位置)
         int n_block;           // blockの個数
         memblock_t *block;     // block list
         memelement_t *not_use; // 未使用element list
     } mempool_t;
 
     static inline void extend_pool(mempool_t *mpool);
+    static inline void __extend_pool(mempool_t *mpool);
     static inline void pool_dump(void *mp);
 
 #if !defined MIN
@@ -45,11 +85,114 @@ extern "C"
 
 #define INCREMENT_ELEMENT(cur, size) cur = (memelement_t *)((char *)(cur) + (sizeof(memelement_t) + size))
 
+#define BITMAP_WORDS(num) (((num) + 63) / 64)
+
     static int __poolalloc_verbose = 0;
 #define VERBOSE(...)              \
     if (__poolalloc_verbose != 0) \
         fprintf(stdout, __VA_ARGS__);
 
+    /**
+     * block領域の確保.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mempool_t *mpool
+     * @param size_t *bytes [in/out] : 必要なサイズ / 確保したサイズ
+     * @param int *mapped [out] : mmapで確保したか
+     * @return void * : cache line境界の領域
+     */
+    static inline void *__pool_block_memory(mempool_t *mpool, size_t *bytes, int *mapped)
+    {
+        *mapped = 0;
+
+        if (mpool->flags & POOL_OPT_HUGEPAGE)
+        {
+            size_t hbytes = (*bytes + POOL_HUGEPAGE_SIZE - 1) & ~((size_t)POOL_HUGEPAGE_SIZE - 1);
+            int mflags = MAP_PRIVATE | MAP_ANONYMOUS | ((mpool->flags & POOL_OPT_PREFAULT) ? MAP_POPULATE : 0);
+#if defined(MAP_HUGETLB)
+            void *p = mmap(NULL, hbytes, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED)
+            {
+                VERBOSE("__pool_block_memory : %p : hugetlb : %p %d\n", mpool, p, (int)hbytes);
+                *bytes = hbytes;
+                *mapped = 1;
+                return p;
+            }
+#endif
+            // hugetlbfsのpageがないのでTHPを使う（2MB境界に合わせるため余分に確保して切り詰める）
+            char *q = (char *)mmap(NULL, hbytes + POOL_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (q != MAP_FAILED)
+            {
+                char *aligned = (char *)(((uintptr_t)q + POOL_HUGEPAGE_SIZE - 1) & ~((uintptr_t)POOL_HUGEPAGE_SIZE - 1));
+                if (aligned > q)
+                {
+                    munmap(q, aligned - q);
+                }
+                if (aligned + hbytes < q + hbytes + POOL_HUGEPAGE_SIZE)
+                {
+                    munmap(aligned + hbytes, (q + hbytes + POOL_HUGEPAGE_SIZE) - (aligned + hbytes));
+                }
+#if defined(MADV_HUGEPAGE)
+                madvise(aligned, hbytes, MADV_HUGEPAGE);
+#endif
+                if (mpool->flags & POOL_OPT_PREFAULT)
+                {
+                    // madvise後に触ってhuge pageで割り当てさせる
+                    size_t off;
+                    for (off = 0; off < hbytes; off += 4096)
+                    {
+                        aligned[off] = 0;
+                    }
+                }
+                VERBOSE("__pool_block_memory : %p : thp : %p %d\n", mpool, aligned, (int)hbytes);
+                *bytes = hbytes;
+                *mapped = 1;
+                return aligned;
+            }
+            VERBOSE("__pool_block_memory : %p : mmap failed : %d\n", mpool, (int)hbytes);
+        }
+        else if (mpool->flags & POOL_OPT_PREFAULT)
+        {
+            long pagesize = sysconf(_SC_PAGESIZE);
+            size_t pbytes = (*bytes + pagesize - 1) & ~((size_t)pagesize - 1);
+            void *p = mmap(NULL, pbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+            if (p != MAP_FAILED)
+            {
+                *bytes = pbytes;
+                *mapped = 1;
+                return p;
+            }
+            VERBOSE("__pool_block_memory : %p : mmap failed : %d\n", mpool, (int)pbytes);
+        }
+
+        void *p = NULL;
+        if (posix_memalign(&p, POOL_CACHE_LINE, *bytes) != 0)
+        {
+            return NULL;
+        }
+        return p;
+    }
+
+    /**
+     * block領域の解放.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param void *p
+     * @param size_t bytes
+     * @param int mapped
+     */
+    static inline void __pool_block_memory_free(void *p, size_t bytes, int mapped)
+    {
+        if (mapped)
+        {
+            munmap(p, bytes);
+        }
+        else
+        {
+            free(p);
+        }
+    }
+
     /**
      * 解放.
      *
@@ -68,9 +211,16 @@ extern "C"
                 // block内のelementの解放
                 if (pblock->element != NULL)
                 {
-                    free(pblock->element);
+                    __pool_block_memory_free(pblock->element, pblock->bytes, pblock->mapped);
                     pblock->element = NULL;
                 }
+                if (pblock->base != NULL)
+                {
+                    __pool_block_memory_free(pblock->base, pblock->bytes, pblock->mapped);
+                    free(pblock->bitmap);
+                    free(pblock->free_idx);
+                    pblock->base = NULL;
+                }
             }
             VERBOSE("release_pool : free block : %p\n", mpool->block);
             // blockの解放
@@ -92,13 +242,59 @@ extern "C"
      */
     static inline memblock_t *alloc_block(mempool_t *mpool, memblock_t *block, int num)
     {
-        block->num = num;
-        block->element = (memelement_t *)malloc((sizeof(memelement_t) + mpool->size) * num);
-        if (block->element == NULL)
+        block->base = NULL;
+        block->element = NULL;
+        block->bitmap = NULL;
+        block->free_idx = NULL;
+        block->n_free = 0;
+        block->use_num = 0;
+
+        // 領域の確保
+        size_t esize = (mpool->flags & POOL_OPT_BITMAP) ? (size_t)mpool->stride : (sizeof(memelement_t) + mpool->size);
+        block->bytes = esize * num;
+        void *mem = __pool_block_memory(mpool, &(block->bytes), &(block->mapped));
+        if (mem == NULL)
         {
-            VERBOSE("alloc_block : malloc failed : %p : block=%p, num=%d, size=%d\n", mpool, block, num, (int)((sizeof(memelement_t) + mpool->size) * num));
+            VERBOSE("alloc_block : alloc failed : %p : block=%p, num=%d, size=%d\n", mpool, block, num, (int)(esize * num));
             return NULL;
         }
+        if (block->mapped)
+        {
+            // page単位に切り上げた分も要素として使う（最大数は超えない）
+            size_t cap = block->bytes / esize;
+            size_t room = (mpool->max_num == 0) ? (size_t)INT_MAX : (size_t)(mpool->max_num - mpool->num);
+            num = (int)MIN(cap, room);
+        }
+        block->num = num;
+
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            block->base = (char *)mem;
+            block->bitmap = (uint64_t *)calloc(BITMAP_WORDS(num), sizeof(uint64_t));
+            block->free_idx = (int *)malloc(sizeof(int) * num);
+            if ((block->bitmap == NULL) || (block->free_idx == NULL))
+            {
+                VERBOSE("alloc_block : bitmap alloc failed : %p : block=%p, num=%d\n", mpool, block, num);
+                __pool_block_memory_free(block->base, block->bytes, block->mapped);
+                free(block->bitmap);
+                free(block->free_idx);
+                block->base = NULL;
+                return NULL;
+            }
+            // 先頭から使われるよう逆順に積む
+            int i;
+            for (i = 0; i < num; i++)
+            {
+                block->free_idx[i] = num - 1 - i;
+            }
+            block->n_free = num;
+            mpool->free_block = block - mpool->block;
+
+            VERBOSE("alloc_block : %p : block=%p, base=%p, num=%d, stride=%d\n", mpool, block, block->base, num, mpool->stride);
+            return block;
+        }
+
+        block->element = (memelement_t *)mem;
 
         VERBOSE("alloc_block : %p : block=%p, element=%p, num=%d, size=%d\n", mpool, block, block->element, num, (int)((sizeof(memelement_t) + mpool->size) * num));
         int i;
@@ -107,13 +303,14 @@ extern "C"
         for (i = 0, pelement = block->element; i < block->num; i++, INCREMENT_ELEMENT(pelement, mpool->size))
         {
             pelement->in_use = 0;
+            pelement->block = block - mpool->block;
             if (prev != NULL)
             {
                 prev->next = pelement;
             }
             prev = pelement;
         }
-        prev->next = NULL; // 最後の要素なのでNULLを入れておく
+        prev->next = mpool->not_use; // 残っている未使用要素をつなぐ(先に拡張した場合)
 
         mpool->not_use = block->element; // 先頭
 
@@ -122,14 +319,15 @@ extern "C"
 
     /**
      * 初期化.
-     * （最大値制限付き）
+     * （最大値制限、option付き）
      *
      * @param int size
      * @param int num
-     * @param int max_num
+     * @param int max_num : 0:制限なし
+     * @param int flags : POOL_OPT_*
      * @return void *
      */
-    static inline void *init_pool_with_max(int size, int num, int max_num)
+    static inline void *init_pool_with_option(int size, int num, int max_num, int flags)
     {
         if ((size <= 0) || (num <= 0))
         {
@@ -140,35 +338,55 @@ extern "C"
         mempool_t *mpool = (mempool_t *)malloc(sizeof(mempool_t));
         if (mpool == NULL)
         {
-            VERBOSE("init_pool_with_max : malloc failed\n");
+            VERBOSE("init_pool_with_option : malloc failed\n");
             return NULL;
         }
-        VERBOSE("init_pool_with_max : %p\n", mpool);
+        VERBOSE("init_pool_with_option : %p\n", mpool);
 
-        mpool->num = num;
+        mpool->num = 0;
         mpool->use_num = 0;
         mpool->max_num = max_num;
-        mpool->size = size;
+        mpool->size = (size + 7) & ~7; // element headerのalignを保つため8byte単位にする
+        mpool->flags = flags;
+        // 8byte単位に詰める。cache line以上のものはcache line単位にする
+        mpool->stride = (size >= POOL_CACHE_LINE) ? ((size + POOL_CACHE_LINE - 1) & ~(POOL_CACHE_LINE - 1)) : ((size + 7) & ~7);
+        mpool->free_block = 0;
+        mpool->not_use = NULL;
         mpool->n_block = 1; // 最初は一つのみ
         mpool->block = (memblock_t *)malloc(sizeof(memblock_t) * 1);
-        VERBOSE("init_pool_with_max : %p : block=%p, size=%d, num=%d, max_num=%d\n", mpool, mpool->block, size, num, max_num);
+        VERBOSE("init_pool_with_option : %p : block=%p, size=%d, num=%d, max_num=%d\n", mpool, mpool->block, size, num, max_num);
         if (mpool->block == NULL)
         {
             free(mpool);
             return NULL;
         }
 
-        memblock_t *b = alloc_block(mpool, mpool->block, mpool->num);
+        memblock_t *b = alloc_block(mpool, mpool->block, num);
         if (b == NULL)
         {
             free(mpool->block);
             free(mpool);
             return NULL;
         }
+        mpool->num = b->num;
 
         return (void *)mpool;
     }
 
+    /**
+     * 初期化.
+     * （最大値制限付き）
+     *
+     * @param int size
+     * @param int num
+     * @param int max_num
+     * @return void *
+     */
+    static inline void *init_pool_with_max(int size, int num, int max_num)
+    {
+        return init_pool_with_option(size, num, max_num, 0);
+    }
+
     /**
      * 初期化.
      *
@@ -188,12 +406,23 @@ extern "C"
      */
     static inline void extend_pool(mempool_t *mpool)
     {
-        if (mpool->not_use != NULL)
+        if (mpool->use_num < mpool->num)
         {
             // まだ空きがある
-            VERBOSE("extend_pool : %p : mpool->not_use != NULL\n", mpool);
+            VERBOSE("extend_pool : %p : mpool->use_num < mpool->num\n", mpool);
             return;
         }
+        __extend_pool(mpool);
+    }
+
+    /**
+     * メモリ領域の拡張（空きの有無に関わらず倍にする）.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mempool_t *mpool
+     */
+    static inline void __extend_pool(mempool_t *mpool)
+    {
         if (mpool->max_num == mpool->num)
         {
             // もうこれ以上は拡張しない
@@ -201,19 +430,41 @@ extern "C"
             return;
         }
 
-        mpool->n_block++;
-        mpool->block = (memblock_t *)realloc(mpool->block, sizeof(memblock_t) * mpool->n_block);
-        if (mpool->block == NULL)
+        int new_num = (mpool->max_num == 0) ? mpool->num : MIN(mpool->num, (mpool->max_num - mpool->num));
+        if (new_num <= 0)
+        {
+            new_num = 1;
+        }
+
+        // pool_trimで解放したblockの枠があれば再利用する（要素のblock indexを変えないため）
+        int i;
+        for (i = 0; i < mpool->n_block; i++)
+        {
+            if (mpool->block[i].num == 0)
+            {
+                memblock_t *b = alloc_block(mpool, &(mpool->block[i]), new_num);
+                if (b == NULL)
+                {
+                    VERBOSE("extend_pool : %p : alloc_block failed : %d\n", mpool, new_num);
+                    return;
+                }
+                VERBOSE("extend_pool : %p : reuse block[%d] : num=%d, new_num=%d\n", mpool, i, mpool->num, mpool->num + b->num);
+                mpool->num += b->num;
+                return;
+            }
+        }
+
+        memblock_t *blocks = (memblock_t *)realloc(mpool->block, sizeof(memblock_t) * (mpool->n_block + 1));
+        if (blocks == NULL)
         {
             // 失敗
-            VERBOSE("extend_pool : %p : block realloc failed : %d\n", mpool, (int)sizeof(memblock_t) * mpool->n_block);
-            mpool->n_block--;
+            VERBOSE("extend_pool : %p : block realloc failed : %d\n", mpool, (int)sizeof(memblock_t) * (mpool->n_block + 1));
             return;
         }
+        mpool->block = blocks;
+        mpool->n_block++;
         VERBOSE("extend_pool : %p : block=%p, bsize=%d, bnum=%d\n", mpool, mpool->block, (int)(sizeof(memblock_t) * mpool->n_block), mpool->n_block);
 
-        int new_num = (mpool->max_num == 0) ? mpool->num : MIN(mpool->num, (mpool->max_num - mpool->num));
-
         memblock_t *b = alloc_block(mpool, &(mpool->block[mpool->n_block - 1]), new_num);
         if (b == NULL)
         {
@@ -222,14 +473,217 @@ extern "C"
             return;
         }
 
-        // printf("extend : %d -> %d\n", mpool->num, mpool->num + new_num);
-        VERBOSE("extend_pool : %p : num=%d, new_num=%d\n", mpool, mpool->num, mpool->num + new_num);
+        // printf("extend : %d -> %d\n", mpool->num, mpool->num + b->num);
+        VERBOSE("extend_pool : %p : num=%d, new_num=%d\n", mpool, mpool->num, mpool->num + b->num);
         // 総個数を増やす
-        mpool->num += new_num;
+        mpool->num += b->num;
 
         return;
     }
 
+    /**
+     * 先行拡張.
+     *
+     * 空きがmin_free個を下回っていたら、使い切る前に拡張しておきます。
+     * （トラフィックの合間などに呼び出し、pool_alloc内での拡張を避けるためのもの）
+     *
+     * @param void *mp
+     * @param int min_free : 確保しておく空き数
+     * @return int : 拡張した:1 / しなかった:0
+     */
+    static inline int pool_grow_ahead(void *mp, int min_free)
+    {
+        mempool_t *mpool = (mempool_t *)mp;
+        int grown = 0;
+
+        while ((mpool->num - mpool->use_num) < min_free)
+        {
+            int num = mpool->num;
+            __extend_pool(mpool);
+            if (mpool->num == num)
+            {
+                // これ以上拡張できない
+                break;
+            }
+            grown = 1;
+        }
+        return grown;
+    }
+
+    /**
+     * 要素を含むblockの検索.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mempool_t *mpool
+     * @param void *element : ユーザデータのアドレス
+     * @return int : block index / 見つからない:-1
+     */
+    static inline int __pool_find_block(mempool_t *mpool, void *element)
+    {
+        int i;
+        memblock_t *b = mpool->block;
+        for (i = 0; i < mpool->n_block; i++, b++)
+        {
+            if (b->num == 0)
+            {
+                // pool_trimで解放済み
+                continue;
+            }
+            char *top = (mpool->flags & POOL_OPT_BITMAP) ? b->base : ((char *)b->element + sizeof(memelement_t));
+            size_t esize = (mpool->flags & POOL_OPT_BITMAP) ? (size_t)mpool->stride : (sizeof(memelement_t) + mpool->size);
+            if (((char *)element >= top) && ((char *)element < top + esize * b->num))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * 指定位置以降の使用中要素の検索.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * 使用中要素のないblock（pool_trimで解放済みのものを含む）は調べません
+     *
+     * @param mempool_t *mpool
+     * @param int bi : 検索開始block
+     * @param int idx : 検索開始index
+     * @return void *
+     */
+    static inline void *__element_find_use(mempool_t *mpool, int bi, int idx)
+    {
+        for (; bi < mpool->n_block; bi++, idx = 0)
+        {
+            memblock_t *b = &(mpool->block[bi]);
+            if (b->use_num == 0)
+            {
+                continue;
+            }
+            memelement_t *e = (memelement_t *)((char *)b->element + (sizeof(memelement_t) + mpool->size) * idx);
+            for (; idx < b->num; idx++, INCREMENT_ELEMENT(e, mpool->size))
+            {
+                if (e->in_use)
+                {
+                    VERBOSE("__element_find_use : %p : data=%p\n", mpool, e->data);
+                    return (void *)(e->data);
+                }
+            }
+        }
+        VERBOSE("__element_find_use : %p : data not found\n", mpool);
+        return NULL;
+    }
+
+    /**
+     * POOL_OPT_BITMAP : 指定位置以降の使用中要素の検索.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mempool_t *mpool
+     * @param int bi : 検索開始block
+     * @param int idx : 検索開始index
+     * @return void *
+     */
+    static inline void *__bitmap_find_use(mempool_t *mpool, int bi, int idx)
+    {
+        for (; bi < mpool->n_block; bi++, idx = 0)
+        {
+            memblock_t *b = &(mpool->block[bi]);
+            int w = idx / 64;
+            if (idx >= b->num)
+            {
+                continue;
+            }
+            uint64_t bits = b->bitmap[w] & (~(uint64_t)0 << (idx % 64));
+            while (1)
+            {
+                if (bits != 0)
+                {
+                    return b->base + (size_t)mpool->stride * (w * 64 + __builtin_ctzll(bits));
+                }
+                if (++w >= BITMAP_WORDS(b->num))
+                {
+                    break;
+                }
+                bits = b->bitmap[w];
+            }
+        }
+        return NULL;
+    }
+
+    /**
+     * POOL_OPT_BITMAP : 要素の取得.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mempool_t *mpool
+     * @return void *
+     */
+    static inline void *__bitmap_pool_alloc(mempool_t *mpool)
+    {
+        if (mpool->use_num >= mpool->num)
+        {
+            // メモリの拡張
+            extend_pool(mpool);
+            if (mpool->use_num >= mpool->num)
+            {
+                // 拡張に失敗した
+                VERBOSE("pool_alloc : %p : extend failed\n", mpool);
+                return NULL;
+            }
+        }
+
+        // 空きのあるblockを探す
+        int i;
+        memblock_t *b = NULL;
+        for (i = 0; i < mpool->n_block; i++)
+        {
+            b = &(mpool->block[(mpool->free_block + i) % mpool->n_block]);
+            if (b->n_free > 0)
+            {
+                break;
+            }
+        }
+        mpool->free_block = b - mpool->block;
+
+        int idx = b->free_idx[--b->n_free];
+        b->bitmap[idx / 64] |= ((uint64_t)1 << (idx % 64));
+
+        mpool->use_num++;
+        char *data = b->base + (size_t)mpool->stride * idx;
+        VERBOSE("pool_alloc : %p : data=%p, use_num=%d\n", mpool, data, mpool->use_num);
+        return (void *)data;
+    }
+
+    /**
+     * POOL_OPT_BITMAP : 要素の開放.
+     * （共通処理。外部から呼ばれることは考えていません）
+     *
+     * @param mempool_t *mpool
+     * @param void *element
+     */
+    static inline void __bitmap_pool_free(mempool_t *mpool, void *element)
+    {
+        int bi = __pool_find_block(mpool, element);
+        if (bi < 0)
+        {
+            VERBOSE("pool_free : %p : unknown data=%p\n", mpool, element);
+            return;
+        }
+        memblock_t *b = &(mpool->block[bi]);
+        int idx = ((char *)element - b->base) / mpool->stride;
+        uint64_t bit = ((uint64_t)1 << (idx % 64));
+        if ((b->bitmap[idx / 64] & bit) == 0)
+        {
+            // 解放済み要素
+            VERBOSE("pool_free : %p : not used data=%p\n", mpool, element);
+            return;
+        }
+        b->bitmap[idx / 64] &= ~bit;
+        b->free_idx[b->n_free++] = idx;
+        mpool->free_block = bi;
+
+        mpool->use_num--;
+        VERBOSE("pool_free : %p : data=%p, use_num=%d\n", mpool, element, mpool->use_num);
+    }
+
     /**
      * 要素の取得.
      *
@@ -242,6 +696,11 @@ extern "C"
     {
         mempool_t *mpool = (mempool_t *)mp;
 
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            return __bitmap_pool_alloc(mpool);
+        }
+
         if (mpool->not_use == NULL)
         {
             // メモリの拡張
@@ -257,6 +716,7 @@ extern "C"
         memelement_t *e = mpool->not_use;
 
         mpool->not_use = e->next;
+        mpool->block[e->block].use_num++;
         // 情報をクリア
         e->in_use = 1;
         e->next = NULL;
@@ -275,6 +735,13 @@ extern "C"
     static inline void pool_free(void *mp, void *element)
     {
         mempool_t *mpool = (mempool_t *)mp;
+
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            __bitmap_pool_free(mpool, element);
+            return;
+        }
+
         memelement_t *pelement = (memelement_t *)((char *)element - sizeof(memelement_t));
 
         if (pelement->in_use == 0)
@@ -284,6 +751,7 @@ extern "C"
             return;
         }
         pelement->in_use = 0;
+        mpool->block[pelement->block].use_num--;
         // memset(pelement->data, 0, mpool->size);
 
         // 未使用リストの先頭に入れる
@@ -307,27 +775,19 @@ extern "C"
     {
         mempool_t *mpool = (mempool_t *)mp;
 
-        int i, j;
-        memblock_t *b = mpool->block;
-        for (i = 0; i < mpool->n_block; i++, b++)
+        if (mpool->flags & POOL_OPT_BITMAP)
         {
-            memelement_t *pelement = b->element;
-            for (j = 0; j < b->num; j++, INCREMENT_ELEMENT(pelement, mpool->size))
-            {
-                if (pelement->in_use == 1)
-                {
-                    VERBOSE("get_element_first : %p : data=%p\n", mpool, pelement->data);
-                    return (void *)(pelement->data);
-                }
-            }
+            return __bitmap_find_use(mpool, 0, 0);
         }
-        VERBOSE("get_element_first : %p : data not found\n", mpool);
-        return NULL;
+
+        return __element_find_use(mpool, 0, 0);
     }
 
     /**
      * 使用している要素の次の要素を得る.
      *
+     * 走査中に現在の要素を解放しても、続けて次の要素を得られます
+     *
      * @param void *mp
      * @param void *element
      * @return void *
@@ -335,71 +795,61 @@ extern "C"
     static inline void *get_element_next(void *mp, void *element)
     {
         mempool_t *mpool = (mempool_t *)mp;
-        memelement_t *pelement = (memelement_t *)((char *)element - sizeof(memelement_t));
 
-        int hit = 0;
-        memblock_t *b = mpool->block;
-        int i, j;
-        for (i = 0; i < mpool->n_block; i++, b++)
+        if (mpool->flags & POOL_OPT_BITMAP)
         {
-            // そのblockの中に含まれている要素かどうか調べる
-            int esize = b->num * (sizeof(memelement_t) + mpool->size);
-
-            if (((unsigned long int)pelement >= (unsigned long int)(b->element)) &&
-                ((unsigned long int)pelement < ((unsigned long int)(b->element) + esize)))
-            { // このblockの要素
-                memelement_t *e = pelement;
-                INCREMENT_ELEMENT(e, mpool->size); // 次の要素から検索スタート
-                int n = ((unsigned long int)e - (unsigned long int)(b->element)) / (sizeof(memelement_t) + mpool->size);
-                for (j = n; j < b->num; j++, INCREMENT_ELEMENT(e, mpool->size))
-                {
-                    if (e->in_use)
-                    {
-                        VERBOSE("get_element_next : %p : current block :  data=%p\n", mpool, e->data);
-                        return (e->data);
-                    }
-                }
-                // このblockにはない
-                hit = 1;
-                continue; // 次のblockへ
-            }
-            // hitしているので要素を調べる
-            if (hit == 1)
+            int bi = __pool_find_block(mpool, element);
+            if (bi < 0)
             {
-                memelement_t *e = b->element;
-                for (j = 0; j < b->num; j++, INCREMENT_ELEMENT(e, mpool->size))
-                {
-                    if (e->in_use)
-                    {
-                        VERBOSE("get_element_next : %p : next block : data=%p\n", mpool, e->data);
-                        return (e->data);
-                    }
-                }
+                return NULL;
             }
+            int idx = ((char *)element - mpool->block[bi].base) / mpool->stride;
+            return __bitmap_find_use(mpool, bi, idx + 1);
         }
-        VERBOSE("get_element_next : %p : data not found\n", mpool);
-        return NULL;
+
+        // element headerにblock indexがある
+        memelement_t *pelement = (memelement_t *)((char *)element - sizeof(memelement_t));
+        int bi = pelement->block;
+        int idx = ((char *)pelement - (char *)mpool->block[bi].element) / (sizeof(memelement_t) + mpool->size);
+        return __element_find_use(mpool, bi, idx + 1);
     }
 
     static inline void foreach_element(void *mp, void *val, int (*func)(void *ele, void *val))
     {
         mempool_t *mpool = (mempool_t *)mp;
-        memblock_t *pblock = mpool->block;
-        int i, j;
-        for (i = 0; i < mpool->n_block; i++, pblock++)
+
+        if (mpool->flags & POOL_OPT_BITMAP)
         {
-            memelement_t *pelement = pblock->element;
-            for (j = 0; j < pblock->num; j++, INCREMENT_ELEMENT(pelement, mpool->size))
+            // wordごとに使用中bitを取り出す
+            int i, w;
+            for (i = 0; i < mpool->n_block; i++)
             {
-                if (pelement->in_use)
+                memblock_t *b = &(mpool->block[i]);
+                for (w = 0; w < BITMAP_WORDS(b->num); w++)
                 {
-                    VERBOSE("foreach_element : %p : data=%p\n", mpool, pelement->data);
-                    if (func((void *)(pelement->data), val) < 0)
+                    uint64_t bits = b->bitmap[w];
+                    while (bits != 0)
                     {
-                        return;
+                        int idx = w * 64 + __builtin_ctzll(bits);
+                        bits &= bits - 1;
+                        if (func((void *)(b->base + (size_t)mpool->stride * idx), val) < 0)
+                        {
+                            return;
+                        }
                     }
                 }
             }
+            return;
+        }
+
+        void *data;
+        for (data = __element_find_use(mpool, 0, 0); data; data = get_element_next(mp, data))
+        {
+            VERBOSE("foreach_element : %p : data=%p\n", mpool, data);
+            if (func(data, val) < 0)
+            {
+                return;
+            }
         }
 
         return;
@@ -419,8 +869,6 @@ extern "C"
     /**
      * 使用している数を返す.
      *
-     * loopで調べているので遅いです
-     *
      * @param void *mp
      * @return int
      */
@@ -438,6 +886,24 @@ extern "C"
      */
     static inline int pool_element_is_valid(void *mp, void *element)
     {
+        mempool_t *mpool = (mempool_t *)mp;
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            int bi = __pool_find_block(mpool, element);
+            if (bi < 0)
+            {
+                return 0;
+            }
+            memblock_t *b = &(mpool->block[bi]);
+            int idx = ((char *)element - b->base) / mpool->stride;
+            return (b->bitmap[idx / 64] >> (idx % 64)) & 1;
+        }
+
+        if (__pool_find_block(mpool, element) < 0)
+        {
+            // poolの要素ではない(pool_trimで解放済みのblockを含む)
+            return 0;
+        }
         memelement_t *pelement = (memelement_t *)((char *)element - sizeof(memelement_t));
         if (pelement->in_use == 0)
         {
@@ -448,6 +914,151 @@ extern "C"
         return 1;
     }
 
+    /**
+     * 要素のindexを得る.
+     *
+     * @param void *mp
+     * @param void *element
+     * @return int : index / poolの要素でない:-1
+     */
+    static inline int pool_get_index(void *mp, void *element)
+    {
+        mempool_t *mpool = (mempool_t *)mp;
+        int bi;
+        size_t offset;
+
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            bi = __pool_find_block(mpool, element);
+            if (bi < 0)
+            {
+                return -1;
+            }
+            offset = ((char *)element - mpool->block[bi].base) / mpool->stride;
+        }
+        else
+        {
+            // element headerにblock indexがある
+            memelement_t *pelement = (memelement_t *)((char *)element - sizeof(memelement_t));
+            bi = pelement->block;
+            offset = ((char *)pelement - (char *)mpool->block[bi].element) / (sizeof(memelement_t) + mpool->size);
+        }
+        return (bi << POOL_INDEX_BLOCK_SHIFT) | (int)offset;
+    }
+
+    /**
+     * indexから使用中の要素を得る.
+     *
+     * @param void *mp
+     * @param int index : pool_get_indexで得たindex
+     * @return void * : 使用中でなければNULL
+     */
+    static inline void *pool_get_element_by_index(void *mp, int index)
+    {
+        mempool_t *mpool = (mempool_t *)mp;
+        int bi = index >> POOL_INDEX_BLOCK_SHIFT;
+        int offset = index & POOL_INDEX_ELEMENT_MASK;
+
+        if ((index < 0) || (bi >= mpool->n_block) || (offset >= mpool->block[bi].num))
+        {
+            // 範囲外(pool_trimで解放済みのblockを含む)
+            return NULL;
+        }
+        memblock_t *b = &(mpool->block[bi]);
+
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            if (((b->bitmap[offset / 64] >> (offset % 64)) & 1) == 0)
+            {
+                return NULL;
+            }
+            return (void *)(b->base + (size_t)mpool->stride * offset);
+        }
+
+        memelement_t *pelement = (memelement_t *)((char *)b->element + (sizeof(memelement_t) + mpool->size) * (size_t)offset);
+        if (pelement->in_use == 0)
+        {
+            return NULL;
+        }
+        return (void *)(pelement->data);
+    }
+
+    /**
+     * 未使用blockの解放.
+     *
+     * 全要素が未使用のblockをOSへ返します（最初のblockは残します）。
+     * 解放後も空き要素がkeep_free個以上残る範囲で解放します。
+     * blockの枠は残し、次の拡張で再利用します。
+     *
+     * @param void *mp
+     * @param int keep_free : 残しておく空き数
+     * @return int : 解放した要素数
+     */
+    static inline int pool_trim(void *mp, int keep_free)
+    {
+        mempool_t *mpool = (mempool_t *)mp;
+        int released = 0;
+        int i;
+
+        for (i = mpool->n_block - 1; i > 0; i--)
+        {
+            memblock_t *b = &(mpool->block[i]);
+            if (b->num == 0)
+            {
+                continue;
+            }
+            int use = (mpool->flags & POOL_OPT_BITMAP) ? (b->num - b->n_free) : b->use_num;
+            if (use > 0)
+            {
+                continue;
+            }
+            if ((mpool->num - mpool->use_num) - b->num < keep_free)
+            {
+                continue;
+            }
+
+            if (mpool->flags & POOL_OPT_BITMAP)
+            {
+                __pool_block_memory_free(b->base, b->bytes, b->mapped);
+                free(b->bitmap);
+                free(b->free_idx);
+                b->base = NULL;
+                b->bitmap = NULL;
+                b->free_idx = NULL;
+                b->n_free = 0;
+                if (mpool->free_block == i)
+                {
+                    mpool->free_block = 0;
+                }
+            }
+            else
+            {
+                // 未使用listからこのblockの要素を外す
+                memelement_t **pp = &(mpool->not_use);
+                while (*pp != NULL)
+                {
+                    if ((*pp)->block == i)
+                    {
+                        *pp = (*pp)->next;
+                    }
+                    else
+                    {
+                        pp = &((*pp)->next);
+                    }
+                }
+                __pool_block_memory_free(b->element, b->bytes, b->mapped);
+                b->element = NULL;
+            }
+            VERBOSE("pool_trim : %p : block[%d] : num=%d\n", mpool, i, b->num);
+            mpool->num -= b->num;
+            released += b->num;
+            b->num = 0;
+            b->bytes = 0;
+        }
+
+        return released;
+    }
+
     /**
      * 情報のdump.
      *
@@ -458,9 +1069,21 @@ extern "C"
         mempool_t *mpool = (mempool_t *)mp;
         memelement_t *pelement;
 
-        printf("POOL DUMP : %d %d %d %d\n", mpool->num, mpool->use_num, mpool->size, mpool->n_block);
+        printf("POOL DUMP : %d %d %d %d %d\n", mpool->num, mpool->use_num, mpool->size, mpool->n_block, mpool->flags);
         memblock_t *pblock = mpool->block;
         int i, j;
+        if (mpool->flags & POOL_OPT_BITMAP)
+        {
+            for (i = 0; i < mpool->n_block; i++, pblock++)
+            {
+                printf("POOL BLOCK [%03d] : %p : %d free=%d base=%p\n", i, pblock, pblock->num, pblock->n_free, pblock->base);
+                for (j = 0; j < BITMAP_WORDS(pblock->num); j++)
+                {
+                    printf("POOL BITMAP [%03d][%03d] : %016llx\n", i, j, (unsigned long long)pblock->bitmap[j]);
+                }
+            }
+            return;
+        }
         for (i = 0; i < mpool->n_block; i++, pblock++)
         {
             pelement = pblock->element;